@@ -0,0 +1,38 @@
+#ifndef CAPS_H
+#define CAPS_H
+
+/* Node capabilities, the REGISTER payload (Server/server.c and the NINA server):
+ *   rxbuf(2) cells(2) enc(1) kcps(2)
+ * rxbuf: largest datagram the node takes; cells: grid cells it holds (rw*rh of its region);
+ * enc: CAPS_ENC_* command-stream features it decodes; kcps: measured speed, thousands of
+ * commands per second (0 = not measured). A node that sends less (older firmware sends only
+ * rxbuf, or nothing) gets what the servers always assumed. The .ino sketches pack it by hand. */
+
+#include <stdint.h>
+
+#define CAPS_LEN        7
+#define CAPS_ENC_STREAM 0x01        // literals and runs (Common/cmdstream.h)
+#define CAPS_ENC_REF    0x02        // back-references
+#define CAPS_ENC_ALL    (CAPS_ENC_STREAM | CAPS_ENC_REF)
+
+typedef struct {
+    int rxbuf, cells, enc, kcps;
+} Caps;
+
+static inline void caps_put(uint8_t *p, const Caps *c) {
+    int kcps = c->kcps > 0xFFFF ? 0xFFFF : c->kcps;
+    p[0] = (c->rxbuf >> 8) & 0xFF; p[1] = c->rxbuf & 0xFF;
+    p[2] = (c->cells >> 8) & 0xFF; p[3] = c->cells & 0xFF;
+    p[4] = c->enc;
+    p[5] = (kcps >> 8) & 0xFF; p[6] = kcps & 0xFF;
+}
+
+// len = payload length; rxbuf and cells = what the server assumes for a node that does not say
+static inline void caps_get(const uint8_t *p, int len, int rxbuf, int cells, Caps *c) {
+    c->rxbuf = len >= 2 ? (p[0] << 8) | p[1] : rxbuf;
+    c->cells = len >= 4 ? (p[2] << 8) | p[3] : cells;
+    c->enc = len >= 5 ? p[4] : CAPS_ENC_ALL;
+    c->kcps = len >= 7 ? (p[5] << 8) | p[6] : 0;
+}
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef CMDSTREAM_H
+#define CMDSTREAM_H
+
+/* Compressed turtle command stream used in DATA/PASS payloads.
+ * Commands are 2-bit opcodes: 0 = F, 1 = +, 2 = -, 3 = anything else (no-op for the turtle).
+ * The stream is a sequence of byte-aligned tokens:
+ *   00aabbcc          literal, exactly three commands a, b, c
+ *   01oonnnn          run, opcode oo repeated nnnn+1 times (1..16)
+ *   1lllllll pppppppp back-reference, replay lllllll+CMD_REF_MIN commands decoded from the
+ *                     token at byte offset pppppppp (which must not contain back-references)
+ * Literals never carry padding, so replaying any token range gives exactly the original commands.
+ * The node decodes command by command straight from the packet (CmdReader), without a buffer
+ * (the NINA node.ino sketch carries a copy of the decoder).
+ * Brackets are not encoded: the server only streams bracket-free runs. */
+
+#include <stdint.h>
+#include <string.h>
+
+#define CMD_RUN_MAX  16
+#define CMD_REF_MIN  7              // shorter replays are cheaper as literals
+#define CMD_REF_MAX  (127 + CMD_REF_MIN)
+#define CMD_MAX_TOK  256            // encoded stream is at most 256 bytes (8-bit offsets)
+
+static inline int cmd_op(char c) {
+    return c == 'F' ? 0 : c == '+' ? 1 : c == '-' ? 2 : 3;
+}
+
+typedef struct {
+    const uint8_t *p;
+    int len;
+    int pos;                        // next token byte
+    int ret;                        // where to resume after a back-reference, -1 = none
+    int ref_left;                   // commands left in the back-reference
+    uint8_t tok;                    // current literal/run token
+    int tok_left;                   // commands left in it
+} CmdReader;
+
+static inline void cmd_reader(CmdReader *r, const uint8_t *p, int len) {
+    r->p = p; r->len = len;
+    r->pos = 0; r->ret = -1; r->ref_left = 0; r->tok_left = 0;
+}
+
+// Next command as 'F', '+', '-' or '.', 0 at the end of the stream (or on a malformed token)
+static inline char cmd_next(CmdReader *r) {
+    if (r->ret >= 0 && r->ref_left == 0) { r->pos = r->ret; r->ret = -1; r->tok_left = 0; }
+    while (r->tok_left == 0) {
+        if (r->pos >= r->len) return 0;
+        uint8_t b = r->p[r->pos++];
+        if (b & 0x80) {
+            if (r->ret >= 0 || r->pos >= r->len) return 0;
+            int to = r->p[r->pos++];
+            if (to >= r->pos - 2) return 0;
+            r->ref_left = (b & 0x7F) + CMD_REF_MIN;
+            r->ret = r->pos; r->pos = to;
+            continue;
+        }
+        r->tok = b;
+        r->tok_left = (b & 0x40) ? (b & 0x0F) + 1 : 3;
+    }
+    int op = (r->tok & 0x40) ? (r->tok >> 4) & 3 : (r->tok >> (2 * (r->tok_left - 1))) & 3;
+    r->tok_left--;
+    if (r->ret >= 0) r->ref_left--;
+    return "F+-."[op];
+}
+
+// Encodes as many of the n commands in s as fit in max bytes (max <= CMD_MAX_TOK).
+// refs = 0 for a decoder without back-references (Common/caps.h CAPS_ENC_REF).
+// Returns the encoded length, *count = number of commands it covers.
+static inline int cmd_encode(const char *s, int n, uint8_t *out, int max, int *count, int refs) {
+    int tok_at[CMD_MAX_TOK], tok_cmd[CMD_MAX_TOK];
+    char tok_ref[CMD_MAX_TOK];
+    int toks = 0, len = 0, i = 0;
+    if (max > CMD_MAX_TOK) max = CMD_MAX_TOK;
+
+    while (i < n) {
+        // Longest replay of an earlier span of literal/run tokens
+        int ref_len = 0, ref_at = 0;
+        for (int k = 0; k < toks && refs; k++) {
+            if (tok_ref[k]) continue;
+            int limit = i - tok_cmd[k];
+            for (int j = k + 1; j < toks; j++) if (tok_ref[j]) { limit = tok_cmd[j] - tok_cmd[k]; break; }
+            if (limit > CMD_REF_MAX) limit = CMD_REF_MAX;
+            int l = 0;
+            while (l < limit && i + l < n && cmd_op(s[tok_cmd[k] + l]) == cmd_op(s[i + l])) l++;
+            if (l > ref_len) { ref_len = l; ref_at = tok_at[k]; }
+        }
+        int op = cmd_op(s[i]), run = 1;
+        while (run < CMD_RUN_MAX && i + run < n && cmd_op(s[i + run]) == op) run++;
+
+        // Pick the token with the most commands per byte: literal 3, run R, reference L/2
+        int need, used;
+        uint8_t tok[2];
+        if (ref_len >= CMD_REF_MIN && ref_len > 2 * run) {
+            need = 2; used = ref_len;
+            tok[0] = 0x80 | (ref_len - CMD_REF_MIN); tok[1] = (uint8_t)ref_at;
+        } else if (run > 3 || i + 3 > n) {
+            need = 1; used = run;
+            tok[0] = 0x40 | (op << 4) | (run - 1);
+        } else {
+            need = 1; used = 3;
+            tok[0] = (op << 4) | (cmd_op(s[i + 1]) << 2) | cmd_op(s[i + 2]);
+        }
+        if (len + need > max) break;
+        tok_at[toks] = len; tok_cmd[toks] = i; tok_ref[toks] = need == 2; toks++;
+        memcpy(&out[len], tok, need);
+        len += need; i += used;
+    }
+    *count = i;
+    return len;
+}
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef FRAG_H
+#define FRAG_H
+
+/* Datagram sizing and fragmentation for Server/server.c and Node/node.c.
+ * path_mtu() gives the UDP payload a datagram to a peer may carry without IP fragmentation
+ * (kernel path MTU, capped by $ALP_MTU to emulate small links). frag_send() sends a whole ALP
+ * packet, split into MSG_FRAG datagrams when it does not fit; frag_add() puts it back together
+ * and the receiver then handles the inner packet as if it had arrived in one piece.
+ *
+ * MSG_FRAG: [ver|0xD][node_id][lenH][lenL] id idx count offH offL <slice of inner packet> CRC */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+
+#include "trace.h"
+
+#define MSG_FRAG     0xD
+#define FRAG_OVER    10             // FRAG header + CRC
+#define FRAG_MAX     4096           // largest reassembled packet
+#define UDP_IP_HDR   28
+#define MIN_DGRAM    64
+
+// Largest UDP payload to `to` that needs no IP fragmentation
+static inline int path_mtu(const struct sockaddr_in *to) {
+    int mtu = 576, v = 0;
+    socklen_t l = sizeof(v);
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s >= 0 && connect(s, (const struct sockaddr *)to, sizeof(*to)) == 0 &&
+        getsockopt(s, IPPROTO_IP, IP_MTU, &v, &l) == 0 && v > 0) mtu = v;
+    if (s >= 0) close(s);
+    const char *cap = getenv("ALP_MTU");
+    if (cap && atoi(cap) > 0 && atoi(cap) < mtu) mtu = atoi(cap);
+    mtu -= UDP_IP_HDR;
+    return mtu < MIN_DGRAM ? MIN_DGRAM : mtu;
+}
+
+// Sends pkt whole if it fits in max_dgram bytes, otherwise as MSG_FRAG slices
+static inline void frag_send(int sock, const struct sockaddr_in *to, const uint8_t *pkt, int len, int max_dgram) {
+    static uint8_t next_id;
+    if (len <= max_dgram) {
+        trace_sendto(sock, pkt, len, 0, (const struct sockaddr *)to, sizeof(*to));
+        return;
+    }
+    int slice = max_dgram - FRAG_OVER;
+    int count = (len + slice - 1) / slice;
+    uint8_t id = next_id++;
+    uint8_t buf[FRAG_MAX + FRAG_OVER];
+    for (int i = 0; i < count; i++) {
+        int off = i * slice, n = len - off < slice ? len - off : slice;
+        buf[0] = (1 << 4) | MSG_FRAG;
+        buf[1] = pkt[1];
+        buf[2] = ((5 + n) >> 8) & 0xFF; buf[3] = (5 + n) & 0xFF;
+        buf[4] = id; buf[5] = i; buf[6] = count;
+        buf[7] = (off >> 8) & 0xFF; buf[8] = off & 0xFF;
+        memcpy(&buf[9], &pkt[off], n);
+        uint8_t crc = 0;
+        for (int k = 0; k < 9 + n; k++) crc += buf[k];
+        buf[9 + n] = crc;
+        trace_sendto(sock, buf, n + FRAG_OVER, 0, (const struct sockaddr *)to, sizeof(*to));
+    }
+}
+
+typedef struct {
+    struct sockaddr_in from;
+    int id, count, got, size;
+    uint8_t seen[256];
+    uint8_t buf[FRAG_MAX];
+} Reasm;
+
+static inline void frag_reset(Reasm *r) { r->id = -1; r->count = 0; }
+
+// One MSG_FRAG datagram (from may be NULL). Returns the inner packet length in r->buf once complete.
+static inline int frag_add(Reasm *r, const struct sockaddr_in *from, const uint8_t *p, int n) {
+    if (n < FRAG_OVER) return 0;
+    int id = p[4], idx = p[5], count = p[6], off = (p[7] << 8) | p[8], len = n - FRAG_OVER;
+    if (idx >= count || off + len > FRAG_MAX) return 0;
+    int other = from && (r->from.sin_addr.s_addr != from->sin_addr.s_addr || r->from.sin_port != from->sin_port);
+    if (id != r->id || count != r->count || other) {
+        r->id = id; r->count = count; r->got = 0; r->size = 0;
+        memset(r->seen, 0, sizeof(r->seen));
+        if (from) r->from = *from;
+    }
+    if (!r->seen[idx]) {
+        r->seen[idx] = 1; r->got++;
+        memcpy(&r->buf[off], &p[9], len);
+        if (off + len > r->size) r->size = off + len;
+    }
+    if (r->got < r->count) return 0;
+    frag_reset(r);
+    return r->size;
+}
+
+#endif
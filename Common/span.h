@@ -0,0 +1,143 @@
+#ifndef SPAN_H
+#define SPAN_H
+
+/* Timing spans for the servers, written as Chrome/Perfetto trace-event JSON.
+ * Set ALP_SPANS=<file.json> and load the file in chrome://tracing or ui.perfetto.dev.
+ *
+ *   SPAN("generate_lsystem");                scoped: ends when the enclosing block does
+ *   span_complete("chunk", t0, lane, arg);   explicit begin/end for asynchronous work
+ *   span_instant("retry", lane, arg);        point event
+ *   span_lane(lane, "Node 3");               names a lane (trace-event tid)
+ *
+ * Every thread records into its own ring buffer (the oldest events are overwritten when it is
+ * full), so recording is a clock read and a store. The rings are written out at exit.
+ * When ALP_SPANS is not set, every call returns after one branch. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define SPAN_RING    65536          // events per thread
+#define SPAN_THREADS 64
+#define SPAN_LANES   64
+
+typedef struct {
+    const char *name;               // string literal
+    uint64_t ts, dur;               // ns
+    int lane;                       // trace-event tid, -1 = the recording thread
+    int arg;                        // shown as args.v, -1 = none
+    char ph;                        // 'X' complete, 'i' instant
+} SpanEv;
+
+typedef struct {
+    SpanEv ev[SPAN_RING];
+    uint32_t n;                     // events recorded so far (ring index = n % SPAN_RING)
+    int tid;
+} SpanRing;
+
+typedef struct {
+    const char *name;
+    uint64_t t0;
+} Span;
+
+static int span_on = -1;            // -1 = not decided yet
+static const char *span_path;
+static SpanRing *span_rings[SPAN_THREADS];
+static int span_ring_count;
+static char span_lane_names[SPAN_LANES][32];
+static __thread SpanRing *span_my;
+
+static inline uint64_t span_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline void span_flush(void) {
+    FILE *f = fopen(span_path, "w");
+    if (!f) { perror(span_path); return; }
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"server\"}}");
+    for (int l = 0; l < SPAN_LANES; l++)
+        if (span_lane_names[l][0])
+            fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                    l, span_lane_names[l]);
+    int count = __atomic_load_n(&span_ring_count, __ATOMIC_ACQUIRE);
+    if (count > SPAN_THREADS) count = SPAN_THREADS;
+    for (int r = 0; r < count; r++) {
+        SpanRing *ring = span_rings[r];
+        if (!ring) continue;
+        uint32_t first = ring->n > SPAN_RING ? ring->n - SPAN_RING : 0;
+        for (uint32_t i = first; i < ring->n; i++) {
+            SpanEv *e = &ring->ev[i % SPAN_RING];
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%.3f", e->name, e->ph,
+                    e->lane >= 0 ? e->lane : ring->tid, e->ts / 1000.0);
+            if (e->ph == 'X') fprintf(f, ",\"dur\":%.3f", e->dur / 1000.0);
+            else fprintf(f, ",\"s\":\"t\"");
+            if (e->arg >= 0) fprintf(f, ",\"args\":{\"v\":%d}", e->arg);
+            fprintf(f, "}");
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    printf("Spans written to %s\n", span_path);
+}
+
+static inline int span_enabled(void) {
+    if (span_on < 0) {
+        span_path = getenv("ALP_SPANS");
+        span_on = span_path && *span_path;
+        if (span_on) atexit(span_flush);
+    }
+    return span_on;
+}
+
+static inline void span_lane(int lane, const char *name) {
+    if (!span_enabled() || lane < 0 || lane >= SPAN_LANES) return;
+    snprintf(span_lane_names[lane], sizeof(span_lane_names[lane]), "%s", name);
+}
+
+static inline void span_record(const char *name, char ph, uint64_t ts, uint64_t dur, int lane, int arg) {
+    if (!span_my) {
+        static __thread int no_ring;
+        if (no_ring) return;
+        int k = __atomic_fetch_add(&span_ring_count, 1, __ATOMIC_ACQ_REL);
+        if (k >= SPAN_THREADS || !(span_my = calloc(1, sizeof(SpanRing)))) { no_ring = 1; return; }
+        // the main thread draws on lane 0 even if a worker records first
+        span_my->tid = syscall(SYS_gettid) == getpid() ? 0 : SPAN_LANES + k;
+        span_rings[k] = span_my;
+    }
+    SpanEv *e = &span_my->ev[span_my->n % SPAN_RING];
+    e->name = name; e->ph = ph; e->ts = ts; e->dur = dur; e->lane = lane; e->arg = arg;
+    span_my->n++;
+}
+
+static inline void span_complete(const char *name, uint64_t t0, int lane, int arg) {
+    if (!span_enabled()) return;
+    uint64_t now = span_now();
+    span_record(name, 'X', t0, now - t0, lane, arg);
+}
+
+static inline void span_instant(const char *name, int lane, int arg) {
+    if (!span_enabled()) return;
+    span_record(name, 'i', span_now(), 0, lane, arg);
+}
+
+static inline Span span_open(const char *name) {
+    Span s = { name, span_enabled() ? span_now() : 0 };
+    return s;
+}
+
+static inline void span_close(Span *s) {
+    if (s->t0) span_record(s->name, 'X', s->t0, span_now() - s->t0, -1, -1);
+}
+
+#define SPAN_CAT(a, b) a##b
+#define SPAN_VAR(line) SPAN_CAT(span_, line)
+#define SPAN(name) Span SPAN_VAR(__LINE__) __attribute__((cleanup(span_close))) = span_open(name)
+
+#endif
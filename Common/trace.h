@@ -0,0 +1,179 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/* Binary packet trace, shared by Server/server.c, Node/node.c and Replay/replay.c.
+ * Set ALP_TRACE=<file> and every ALP datagram sent or received goes into an append-only,
+ * memory-mapped file with a CLOCK_MONOTONIC timestamp. Records are written straight into a
+ * MAP_SHARED mapping, so a node killed with SIGTERM still leaves a complete trace behind.
+ *
+ * File:   "ALPTRC01" then records, each padded to 8 bytes; a record with t_ns == 0 ends the file.
+ * Record: TraceRec (host byte order, addr/port as on the wire) followed by len bytes of datagram.
+ * Every process that opens the trace starts a session with a TRACE_OPEN record ("name pid").
+ *
+ * One file per process: "%p" in the path expands to the pid (ALP_TRACE=/tmp/alp-%p.trc), and the
+ * writer holds an exclusive flock() on its file, so a second process pointed at the same file
+ * gets a warning and no trace instead of overwriting records. Reopening later appends a session. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define TRACE_MAGIC "ALPTRC01"
+#define TRACE_GROW  (1 << 20)
+#define TRACE_RX    0
+#define TRACE_TX    1
+#define TRACE_OPEN  2
+
+typedef struct {
+    uint64_t t_ns;                  // CLOCK_MONOTONIC, 0 = end of trace
+    uint32_t addr;                  // peer IPv4 (network order)
+    uint16_t port;                  // peer port (network order)
+    uint8_t dir;                    // TRACE_RX / TRACE_TX / TRACE_OPEN
+    uint8_t pad;
+    uint32_t len;                   // datagram bytes after the record
+    uint32_t pad2;
+} TraceRec;
+
+#define TRACE_SIZE(len) ((sizeof(TraceRec) + (len) + 7) & ~(size_t)7)
+
+static int trace_fd = -1;
+static uint8_t *trace_map;
+static size_t trace_cap, trace_end;
+
+static inline uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// A complete record starts at off
+static inline int trace_valid(const uint8_t *map, size_t size, size_t off) {
+    if (off + sizeof(TraceRec) > size) return 0;
+    const TraceRec *r = (const TraceRec *)(map + off);
+    return r->t_ns != 0 && off + TRACE_SIZE(r->len) <= size;
+}
+
+// Next complete record after the (valid) one at off, 0 at the end of the trace
+static inline size_t trace_next(const uint8_t *map, size_t size, size_t off) {
+    size_t next = off + TRACE_SIZE(((const TraceRec *)(map + off))->len);
+    return trace_valid(map, size, next) ? next : 0;
+}
+
+static inline int trace_map_file(size_t cap) {
+    if (trace_map) munmap(trace_map, trace_cap);
+    trace_map = NULL;
+    if (ftruncate(trace_fd, cap) < 0) return -1;
+    void *m = mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_SHARED, trace_fd, 0);
+    if (m == MAP_FAILED) return -1;
+    trace_map = m; trace_cap = cap;
+    return 0;
+}
+
+static inline void trace_close(void) {
+    if (trace_fd < 0) return;
+    if (trace_map) munmap(trace_map, trace_cap);
+    // Only the lock holder writes the file, so trace_end is its real end
+    if (ftruncate(trace_fd, trace_end) < 0) perror("trace");
+    close(trace_fd);
+    trace_fd = -1; trace_map = NULL;
+}
+
+static inline void trace_record(int dir, const struct sockaddr_in *peer, const void *buf, size_t len) {
+    if (trace_fd < 0) return;
+    size_t need = trace_end + TRACE_SIZE(len) + sizeof(TraceRec);
+    if (need > trace_cap && trace_map_file((need / TRACE_GROW + 1) * TRACE_GROW) < 0) {
+        perror("trace");
+        close(trace_fd); trace_fd = -1;
+        return;
+    }
+    TraceRec *r = (TraceRec *)(trace_map + trace_end);
+    memset(r, 0, TRACE_SIZE(len));
+    r->addr = peer ? peer->sin_addr.s_addr : 0;
+    r->port = peer ? peer->sin_port : 0;
+    r->dir = dir;
+    r->len = len;
+    memcpy(r + 1, buf, len);
+    __atomic_store_n(&r->t_ns, trace_now(), __ATOMIC_RELEASE);   // published last
+    trace_end += TRACE_SIZE(len);
+}
+
+// $ALP_TRACE with "%p" replaced by the pid and "%%" by "%"
+static inline int trace_path(char *out, size_t size) {
+    const char *in = getenv("ALP_TRACE");
+    if (!in || !*in) return 0;
+    size_t n = 0;
+    for (; *in && n + 1 < size; in++) {
+        if (in[0] == '%' && in[1] == 'p') {
+            n += snprintf(out + n, size - n, "%d", (int)getpid());
+            in++;
+        } else {
+            if (in[0] == '%' && in[1] == '%') in++;
+            out[n++] = *in;
+        }
+        if (n >= size) return 0;
+    }
+    if (*in) return 0;
+    out[n] = 0;
+    return 1;
+}
+
+// Opens $ALP_TRACE for appending; does nothing when it is not set
+static inline void trace_open(const char *name) {
+    char path[512];
+    if (!trace_path(path, sizeof(path))) return;
+    trace_fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (trace_fd < 0) { perror("trace"); return; }
+    if (flock(trace_fd, LOCK_EX | LOCK_NB) < 0) {
+        fprintf(stderr, "trace: %s is written by another process, not tracing (use %%p in ALP_TRACE)\n", path);
+        close(trace_fd); trace_fd = -1;
+        return;
+    }
+    if (fstat(trace_fd, &st) < 0) { perror("trace"); close(trace_fd); trace_fd = -1; return; }
+
+    size_t size = st.st_size;
+    if (trace_map_file((size / TRACE_GROW + 1) * TRACE_GROW) < 0) { perror("trace"); close(trace_fd); trace_fd = -1; return; }
+    if (size < 8 || memcmp(trace_map, TRACE_MAGIC, 8) != 0) {
+        memcpy(trace_map, TRACE_MAGIC, 8);
+        trace_end = 8;
+    } else {
+        // Append after the last complete record (a killed writer leaves zeroed space behind)
+        size_t off = 8, next;
+        if (trace_valid(trace_map, size, off)) {
+            while ((next = trace_next(trace_map, size, off))) off = next;
+            off += TRACE_SIZE(((TraceRec *)(trace_map + off))->len);
+        }
+        trace_end = off;
+    }
+    char tag[64];
+    int n = snprintf(tag, sizeof(tag), "%s %d", name, (int)getpid());
+    trace_record(TRACE_OPEN, NULL, tag, n);
+    atexit(trace_close);
+    printf("Tracing to %s\n", path);
+}
+
+static inline ssize_t trace_sendto(int fd, const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t tolen) {
+    ssize_t n = sendto(fd, buf, len, flags, to, tolen);
+    if (n > 0) trace_record(TRACE_TX, (const struct sockaddr_in *)to, buf, n);
+    return n;
+}
+
+static inline ssize_t trace_recvfrom(int fd, void *buf, size_t len, int flags, struct sockaddr *from, socklen_t *fromlen) {
+    struct sockaddr_in tmp;
+    socklen_t tmplen = sizeof(tmp);
+    if (!from) { from = (struct sockaddr *)&tmp; fromlen = &tmplen; }
+    ssize_t n = recvfrom(fd, buf, len, flags, from, fromlen);
+    if (n > 0) trace_record(TRACE_RX, (const struct sockaddr_in *)from, buf, n);
+    return n;
+}
+
+#endif
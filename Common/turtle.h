@@ -0,0 +1,217 @@
+#ifndef TURTLE_H
+#define TURTLE_H
+
+/* Shared turtle geometry for Server/server.c, Node/node.c and the NINA server
+ * (the NINA node.ino sketch carries its own copy - Arduino cannot include files outside the sketch).
+ * Positions are Q16.16 fixed point, directions come from a table built once at startup,
+ * F moves are clipped to a region (Liang-Barsky) and rasterised cell by cell (integer DDA).
+ * Server dead-reckoning and node drawing use the same code, so they agree bit for bit. */
+
+#include <stdint.h>
+
+#define FX_SHIFT 16
+#define FX_ONE   ((int32_t)1 << FX_SHIFT)
+#define FX_FRAC  (FX_ONE - 1)
+#define FX(v)    ((int32_t)((v) * FX_ONE))
+#define REM_ONE  32768              // pending part of an F, Q15 (0 = nothing pending)
+
+typedef struct {
+    int32_t x, y;                   // Q16.16 canvas units
+    int16_t deg;                    // 0..359
+    uint16_t rem;                   // rest of the last F after it crossed a region boundary
+} Turtle;
+
+typedef void (*plot_fn)(int cx, int cy, void *ctx);
+
+static int32_t fx_sin_q[91];        // sin(0..90 deg), Q16
+
+static inline void turtle_init(void) {
+    for (int i = 0; i <= 90; i++) {
+        double x = i * (3.14159265358979 / 180.0), x2 = x * x;
+        double s = x * (1 - x2 / 6 * (1 - x2 / 20 * (1 - x2 / 42 * (1 - x2 / 72))));
+        fx_sin_q[i] = (int32_t)(s * FX_ONE + 0.5);
+    }
+    fx_sin_q[0] = 0; fx_sin_q[30] = FX_ONE / 2; fx_sin_q[90] = FX_ONE;
+}
+
+static inline int32_t fx_sin(int deg) {
+    deg %= 360;
+    if (deg < 0) deg += 360;
+    if (deg <= 90) return fx_sin_q[deg];
+    if (deg <= 180) return fx_sin_q[180 - deg];
+    if (deg <= 270) return -fx_sin_q[deg - 180];
+    return -fx_sin_q[360 - deg];
+}
+
+static inline int32_t fx_cos(int deg) { return fx_sin(deg + 90); }
+
+static inline void turtle_turn(Turtle *t, int delta) {
+    int d = (t->deg + delta) % 360;
+    t->deg = (int16_t)(d < 0 ? d + 360 : d);
+}
+
+// Move vector of the pending part (or a whole F), Q16
+static inline void turtle_vector(const Turtle *t, int32_t step, int32_t *dx, int32_t *dy) {
+    int32_t len = t->rem ? t->rem : REM_ONE;
+    *dx = (int32_t)(((int64_t)step * fx_cos(t->deg) >> FX_SHIFT) * len >> 15);
+    *dy = (int32_t)(((int64_t)step * fx_sin(t->deg) >> FX_SHIFT) * len >> 15);
+}
+
+// Cell a move along d starts in / ends in. A point on a grid line belongs to the cell the move is inside.
+static inline int fx_cell_from(int32_t v, int32_t d) {
+    int c = (int)(v >> FX_SHIFT);
+    if (d < 0 && (v & FX_FRAC) == 0) c--;
+    return c;
+}
+
+static inline int fx_cell_to(int32_t v, int32_t d) {
+    int c = (int)(v >> FX_SHIFT);
+    if (d > 0 && (v & FX_FRAC) == 0) c--;
+    return c;
+}
+
+// Cell that owns the turtle: with a pending move it is the cell that move starts in
+static inline void turtle_cell(const Turtle *t, int32_t step, int *cx, int *cy) {
+    int32_t dx = 0, dy = 0;
+    if (t->rem) turtle_vector(t, step, &dx, &dy);
+    *cx = fx_cell_from(t->x, dx);
+    *cy = fx_cell_from(t->y, dy);
+}
+
+// Every cell the segment a->b passes through
+static inline void rast_segment(int32_t ax, int32_t ay, int32_t bx, int32_t by, plot_fn plot, void *ctx) {
+    int32_t dx = bx - ax, dy = by - ay;
+    int sx = dx > 0 ? 1 : (dx < 0 ? -1 : 0);
+    int sy = dy > 0 ? 1 : (dy < 0 ? -1 : 0);
+    int cx = fx_cell_from(ax, dx), cy = fx_cell_from(ay, dy);
+    int ex = fx_cell_to(bx, dx), ey = fx_cell_to(by, dy);
+    int64_t adx = dx < 0 ? -(int64_t)dx : dx, ady = dy < 0 ? -(int64_t)dy : dy;
+    // distance to the next vertical / horizontal grid line
+    int64_t nx = sx > 0 ? (int64_t)(cx + 1) * FX_ONE - ax : ax - (int64_t)cx * FX_ONE;
+    int64_t ny = sy > 0 ? (int64_t)(cy + 1) * FX_ONE - ay : ay - (int64_t)cy * FX_ONE;
+
+    plot(cx, cy, ctx);
+    while (cx != ex || cy != ey) {
+        if (cy == ey || (cx != ex && nx * ady <= ny * adx)) { cx += sx; nx += FX_ONE; }
+        else { cy += sy; ny += FX_ONE; }
+        plot(cx, cy, ctx);
+    }
+}
+
+// Liang-Barsky: part of a->a+d inside [x0,x1)x[y0,y1) (cells) as Q16 parameters t0..t1.
+// Sides are 0..3 = x0,x1,y0,y1 (4 = none). Returns the side bounding t1, -1 if the segment misses.
+static inline int rast_clip(int32_t ax, int32_t ay, int32_t dx, int32_t dy, int x0, int y0, int x1, int y1,
+                     int32_t *t0, int32_t *t1, int *in_side) {
+    int64_t p[4] = { -(int64_t)dx, dx, -(int64_t)dy, dy };
+    int64_t q[4] = { (int64_t)ax - (int64_t)x0 * FX_ONE, (int64_t)x1 * FX_ONE - ax,
+                     (int64_t)ay - (int64_t)y0 * FX_ONE, (int64_t)y1 * FX_ONE - ay };
+    int64_t lo = 0, hi = FX_ONE;
+    int side = 4, enter = 4;
+    for (int k = 0; k < 4; k++) {
+        if (p[k] == 0) {
+            if (q[k] < 0) return -1;
+            continue;
+        }
+        int64_t t = q[k] * FX_ONE / p[k];
+        if (p[k] < 0) { if (t > lo) { lo = t; enter = k; } }
+        else if (t < hi) { hi = t; side = k; }
+    }
+    if (lo > hi) return -1;
+    *t0 = (int32_t)lo; *t1 = (int32_t)hi; *in_side = enter;
+    return side;
+}
+
+// Point at parameter t on the pending move, snapped onto the boundary side it lies on
+static inline void turtle_move_to(Turtle *t, int32_t dx, int32_t dy, int32_t at, int side, int x0, int y0, int x1, int y1) {
+    int32_t len = t->rem ? t->rem : REM_ONE;
+    t->x += (int32_t)(((int64_t)dx * at) >> FX_SHIFT);
+    t->y += (int32_t)(((int64_t)dy * at) >> FX_SHIFT);
+    if (side == 0) t->x = (int32_t)x0 * FX_ONE;
+    else if (side == 1) t->x = (int32_t)x1 * FX_ONE;
+    else if (side == 2) t->y = (int32_t)y0 * FX_ONE;
+    else if (side == 3) t->y = (int32_t)y1 * FX_ONE;
+    int32_t rest = len - (int32_t)(((int64_t)len * at) >> FX_SHIFT);
+    t->rem = (uint16_t)(rest < 1 ? 1 : rest);
+}
+
+// One F (or its pending rest) drawn inside the region. Returns 1 when the move leaves the region:
+// the turtle then stands on the boundary and t->rem holds the fraction still to be drawn next door.
+static inline int turtle_forward(Turtle *t, int32_t step, int x0, int y0, int x1, int y1, plot_fn plot, void *ctx) {
+    int32_t dx, dy, t0, t1;
+    int in_side;
+    turtle_vector(t, step, &dx, &dy);
+    int cx = fx_cell_from(t->x, dx), cy = fx_cell_from(t->y, dy);
+    if (cx < x0 || cx >= x1 || cy < y0 || cy >= y1) {
+        if (!t->rem) t->rem = REM_ONE;
+        return 1;
+    }
+
+    int side = rast_clip(t->x, t->y, dx, dy, x0, y0, x1, y1, &t0, &t1, &in_side);
+    if (side < 0 || side == 4 || t1 >= FX_ONE) {
+        rast_segment(t->x, t->y, t->x + dx, t->y + dy, plot, ctx);
+        t->x += dx; t->y += dy; t->rem = 0;
+        return 0;
+    }
+    int32_t sx = t->x, sy = t->y;
+    turtle_move_to(t, dx, dy, t1, side, x0, y0, x1, y1);
+    if (t1 > 0) rast_segment(sx, sy, t->x, t->y, plot, ctx);
+    return 1;
+}
+
+// Pending move (or a whole F) without drawing
+static inline void turtle_advance(Turtle *t, int32_t step) {
+    int32_t dx, dy;
+    turtle_vector(t, step, &dx, &dy);
+    t->x += dx; t->y += dy; t->rem = 0;
+}
+
+// Turtle outside the region: stop where the pending move enters it. Returns 0 if it never does.
+static inline int turtle_enter(Turtle *t, int32_t step, int x0, int y0, int x1, int y1) {
+    int32_t dx, dy, t0, t1;
+    int in_side;
+    turtle_vector(t, step, &dx, &dy);
+    int side = rast_clip(t->x, t->y, dx, dy, x0, y0, x1, y1, &t0, &t1, &in_side);
+    if (side < 0 || t0 <= 0 || t0 >= t1) return 0;
+    turtle_move_to(t, dx, dy, t0, in_side, x0, y0, x1, y1);
+    return 1;
+}
+
+// Pending move (or a whole F) if it ends inside [x0,x1)x[y0,y1); both ends inside a convex region
+// means the whole segment is, so no clipping is needed. Returns 0 (turtle unchanged) otherwise.
+static inline int turtle_step_inside(Turtle *t, int32_t step, int x0, int y0, int x1, int y1) {
+    int32_t dx, dy;
+    turtle_vector(t, step, &dx, &dy);
+    int cx = fx_cell_to(t->x + dx, dx), cy = fx_cell_to(t->y + dy, dy);
+    if (cx < x0 || cx >= x1 || cy < y0 || cy >= y1) return 0;
+    t->x += dx; t->y += dy; t->rem = 0;
+    return 1;
+}
+
+// How many of the n commands in s run before an F leaves the region (that F included)
+static inline int turtle_span_inside(const char *s, int n, Turtle t, int32_t step, int angle, int x0, int y0, int x1, int y1) {
+    if (t.rem && !turtle_step_inside(&t, step, x0, y0, x1, y1)) return 0;
+    for (int i = 0; i < n; i++) {
+        if (s[i] == '+') turtle_turn(&t, angle);
+        else if (s[i] == '-') turtle_turn(&t, -angle);
+        else if (s[i] == 'F' && !turtle_step_inside(&t, step, x0, y0, x1, y1)) return i + 1;
+    }
+    return n;
+}
+
+// Wire format of a turtle state, 12 bytes big-endian: x(4) y(4) deg(2) rem(2)
+static inline void turtle_put(uint8_t *b, const Turtle *t) {
+    uint32_t x = (uint32_t)t->x, y = (uint32_t)t->y;
+    b[0] = x >> 24; b[1] = x >> 16; b[2] = x >> 8; b[3] = x;
+    b[4] = y >> 24; b[5] = y >> 16; b[6] = y >> 8; b[7] = y;
+    b[8] = (uint16_t)t->deg >> 8; b[9] = t->deg & 0xFF;
+    b[10] = t->rem >> 8; b[11] = t->rem & 0xFF;
+}
+
+static inline void turtle_get(const uint8_t *b, Turtle *t) {
+    t->x = (int32_t)(((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3]);
+    t->y = (int32_t)(((uint32_t)b[4] << 24) | ((uint32_t)b[5] << 16) | ((uint32_t)b[6] << 8) | b[7]);
+    t->deg = (int16_t)((b[8] << 8) | b[9]);
+    t->rem = (uint16_t)((b[10] << 8) | b[11]);
+}
+
+#endif
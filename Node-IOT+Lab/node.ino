@@ -16,6 +16,7 @@
 
 #define MAX_REGION 32
 #define BUF_SIZE 256
+#define MAX_STACK 16
 
 char grid[MAX_REGION][MAX_REGION];
 
@@ -24,6 +25,10 @@ int g_angle;
 int cur_x, cur_y;
 int dir;   // 0=up 1=right 2=down 3=left
 
+// Stos żółwia dla [ ]
+int st_x[MAX_STACK], st_y[MAX_STACK], st_dir[MAX_STACK];
+int sp = 0;
+
 ZsutEthernetUDP Udp;
 
 /* ================= CRC ================= */
@@ -126,6 +131,12 @@ void loop(){
             if(c=='F') step_forward();
             else if(c=='+') dir=(dir+1)&3;
             else if(c=='-') dir=(dir+3)&3;
+            else if(c=='[' && sp<MAX_STACK){
+                st_x[sp]=cur_x; st_y[sp]=cur_y; st_dir[sp]=dir; sp++;
+            }
+            else if(c==']' && sp>0){
+                sp--; cur_x=st_x[sp]; cur_y=st_y[sp]; dir=st_dir[sp];
+            }
         }
     }
 
@@ -12,11 +12,12 @@
 #define MSG_HANDOVER 0x7
 #define MSG_REQ_COORDS  0x8
 #define MSG_RESP_COORDS 0x9
+#define MSG_HEARTBEAT   0xC
 
 // ============================================
 // !!! IP TWOJEGO SERVERA (UPEWNIJ SIE ZE DOBRE) !!!
 #define SERVER_IP ZsutIPAddress(192,168,89,10) 
-// Ustaw odpowiednie ID dla każdego pliku hex (1, 2, 3, 4)
+// Ustaw odpowiednie ID dla każdego pliku hex (1, 2, 3, 4; 5 i 6 = nody zapasowe dla failovera)
 #define NODE_ID 4
 // ============================================
 
@@ -25,13 +26,18 @@
 
 #define MAX_REGION 32
 #define BUF_SIZE 512
+#define REGISTER_MS  500    // REGISTER co tyle, dopóki serwer nie potwierdzi
+#define HEARTBEAT_MS 500    // potem HEARTBEAT co tyle - serwer po 2 s ciszy uznaje noda za martwego
 
 char grid[MAX_REGION][MAX_REGION];
 int rx = 0, ry = 0, rw = 0, rh = 0; // Inicjalizacja na 0
 bool configured = false;
+bool registered = false;
+uint16_t kcps = 1;
+unsigned long reg_last = 0, hb_last = 0;
 
-double turn_angle = 90.0;
-double move_step = 1.0;
+int turn_angle = 90;
+int32_t move_step = 65536;   // Q16.16
 
 ZsutEthernetUDP Udp;
 
@@ -45,6 +51,204 @@ void pack_header(uint8_t *buf, int type, uint8_t seq, int payload_len){
     buf[3] = (payload_len >> 8) & 0xFF; buf[4] = payload_len & 0xFF;
 }
 
+/* ===== Geometria żółwia (kopia Common/turtle.h - szkic Arduino nie widzi plików spoza katalogu) =====
+   Pozycje w Q16.16, kierunki z tablicy liczonej raz w setup(), ruch F obcinany do regionu (Liang-Barsky)
+   i rasteryzowany komórka po komórce (DDA). Bez cos/sin/round w pętli. */
+#define FX_SHIFT 16
+#define FX_ONE   ((int32_t)1 << FX_SHIFT)
+#define FX_FRAC  (FX_ONE - 1)
+#define REM_ONE  32768
+
+struct Turtle {
+    int32_t x, y;
+    int16_t deg;
+    uint16_t rem;   // reszta ostatniego F po przekroczeniu granicy regionu (Q15)
+};
+
+int32_t fx_sin_q[91];
+
+void turtle_init() {
+    for (int i = 0; i <= 90; i++) {
+        double x = i * (3.14159265358979 / 180.0), x2 = x * x;
+        double s = x * (1 - x2 / 6 * (1 - x2 / 20 * (1 - x2 / 42 * (1 - x2 / 72))));
+        fx_sin_q[i] = (int32_t)(s * FX_ONE + 0.5);
+    }
+    fx_sin_q[0] = 0; fx_sin_q[30] = FX_ONE / 2; fx_sin_q[90] = FX_ONE;
+}
+
+int32_t fx_sin(int deg) {
+    deg %= 360;
+    if (deg < 0) deg += 360;
+    if (deg <= 90) return fx_sin_q[deg];
+    if (deg <= 180) return fx_sin_q[180 - deg];
+    if (deg <= 270) return -fx_sin_q[deg - 180];
+    return -fx_sin_q[360 - deg];
+}
+
+int32_t fx_cos(int deg) { return fx_sin(deg + 90); }
+
+void turtle_turn(Turtle *t, int delta) {
+    int d = (t->deg + delta) % 360;
+    t->deg = d < 0 ? d + 360 : d;
+}
+
+void turtle_vector(const Turtle *t, int32_t *dx, int32_t *dy) {
+    int32_t len = t->rem ? t->rem : REM_ONE;
+    *dx = (int32_t)(((int64_t)move_step * fx_cos(t->deg) >> FX_SHIFT) * len >> 15);
+    *dy = (int32_t)(((int64_t)move_step * fx_sin(t->deg) >> FX_SHIFT) * len >> 15);
+}
+
+int fx_cell_from(int32_t v, int32_t d) {
+    int c = (int)(v >> FX_SHIFT);
+    if (d < 0 && (v & FX_FRAC) == 0) c--;
+    return c;
+}
+
+int fx_cell_to(int32_t v, int32_t d) {
+    int c = (int)(v >> FX_SHIFT);
+    if (d > 0 && (v & FX_FRAC) == 0) c--;
+    return c;
+}
+
+void plot_cell(int cx, int cy) {
+    if (cx >= rx && cx < rx + rw && cy >= ry && cy < ry + rh) grid[cy - ry][cx - rx] = '#';
+}
+
+void rast_segment(int32_t ax, int32_t ay, int32_t bx, int32_t by) {
+    int32_t dx = bx - ax, dy = by - ay;
+    int sx = dx > 0 ? 1 : (dx < 0 ? -1 : 0);
+    int sy = dy > 0 ? 1 : (dy < 0 ? -1 : 0);
+    int cx = fx_cell_from(ax, dx), cy = fx_cell_from(ay, dy);
+    int ex = fx_cell_to(bx, dx), ey = fx_cell_to(by, dy);
+    int64_t adx = dx < 0 ? -(int64_t)dx : dx, ady = dy < 0 ? -(int64_t)dy : dy;
+    int64_t nx = sx > 0 ? (int64_t)(cx + 1) * FX_ONE - ax : ax - (int64_t)cx * FX_ONE;
+    int64_t ny = sy > 0 ? (int64_t)(cy + 1) * FX_ONE - ay : ay - (int64_t)cy * FX_ONE;
+
+    plot_cell(cx, cy);
+    while (cx != ex || cy != ey) {
+        if (cy == ey || (cx != ex && nx * ady <= ny * adx)) { cx += sx; nx += FX_ONE; }
+        else { cy += sy; ny += FX_ONE; }
+        plot_cell(cx, cy);
+    }
+}
+
+// Zwraca 1 gdy ruch opuszcza region: żółw stoi na granicy, t->rem = reszta odcinka dla sąsiada
+bool turtle_forward(Turtle *t) {
+    int32_t dx, dy;
+    turtle_vector(t, &dx, &dy);
+    int x0 = rx, y0 = ry, x1 = rx + rw, y1 = ry + rh;
+    int cx = fx_cell_from(t->x, dx), cy = fx_cell_from(t->y, dy);
+    if (cx < x0 || cx >= x1 || cy < y0 || cy >= y1) {
+        if (!t->rem) t->rem = REM_ONE;
+        return true;
+    }
+
+    // Liang-Barsky: parametr wyjścia z regionu (Q16)
+    int64_t p[4] = { -(int64_t)dx, dx, -(int64_t)dy, dy };
+    int64_t q[4] = { (int64_t)t->x - (int64_t)x0 * FX_ONE, (int64_t)x1 * FX_ONE - t->x,
+                     (int64_t)t->y - (int64_t)y0 * FX_ONE, (int64_t)y1 * FX_ONE - t->y };
+    int64_t t1 = FX_ONE;
+    int side = 4;
+    for (int k = 0; k < 4; k++) {
+        if (p[k] <= 0) continue;
+        int64_t tk = q[k] * FX_ONE / p[k];
+        if (tk < t1) { t1 = tk; side = k; }
+    }
+    if (side == 4) {
+        rast_segment(t->x, t->y, t->x + dx, t->y + dy);
+        t->x += dx; t->y += dy; t->rem = 0;
+        return false;
+    }
+
+    int32_t sx = t->x, sy = t->y;
+    int32_t len = t->rem ? t->rem : REM_ONE;
+    t->x += (int32_t)(((int64_t)dx * t1) >> FX_SHIFT);
+    t->y += (int32_t)(((int64_t)dy * t1) >> FX_SHIFT);
+    if (side == 0) t->x = (int32_t)x0 * FX_ONE;
+    else if (side == 1) t->x = (int32_t)x1 * FX_ONE;
+    else if (side == 2) t->y = (int32_t)y0 * FX_ONE;
+    else t->y = (int32_t)y1 * FX_ONE;
+    int32_t rest = len - (int32_t)(((int64_t)len * t1) >> FX_SHIFT);
+    t->rem = rest < 1 ? 1 : rest;
+    if (t1 > 0) rast_segment(sx, sy, t->x, t->y);
+    return true;
+}
+
+// Stan żółwia na łączu, 12 bajtów big-endian: x(4) y(4) deg(2) rem(2)
+void turtle_put(uint8_t *b, const Turtle *t) {
+    uint32_t x = (uint32_t)t->x, y = (uint32_t)t->y;
+    b[0] = x >> 24; b[1] = x >> 16; b[2] = x >> 8; b[3] = x;
+    b[4] = y >> 24; b[5] = y >> 16; b[6] = y >> 8; b[7] = y;
+    b[8] = (uint16_t)t->deg >> 8; b[9] = t->deg & 0xFF;
+    b[10] = t->rem >> 8; b[11] = t->rem & 0xFF;
+}
+
+void turtle_get(const uint8_t *b, Turtle *t) {
+    t->x = (int32_t)(((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3]);
+    t->y = (int32_t)(((uint32_t)b[4] << 24) | ((uint32_t)b[5] << 16) | ((uint32_t)b[6] << 8) | b[7]);
+    t->deg = (int16_t)((b[8] << 8) | b[9]);
+    t->rem = (uint16_t)((b[10] << 8) | b[11]);
+}
+
+/* ===== Skompresowany strumień komend (kopia dekodera z Common/cmdstream.h) =====
+   Tokeny: 00aabbcc = 3 komendy, 01oonnnn = komenda oo powtórzona n+1 razy,
+   1lllllll pppppppp = powtórz l+7 komend od tokenu pod offsetem p. Opkody: 0=F 1=+ 2=- 3=nic.
+   Dekodujemy komendę po komendzie prosto z bufora pakietu - bez bufora pośredniego. */
+#define CMD_REF_MIN 7
+
+struct CmdReader {
+    const uint8_t *p;
+    int len, pos;
+    int ret, ref_left;      // powrót po referencji (-1 = brak), ile komend referencji zostało
+    uint8_t tok;
+    int tok_left;
+};
+
+void cmd_reader(CmdReader *r, const uint8_t *p, int len) {
+    r->p = p; r->len = len;
+    r->pos = 0; r->ret = -1; r->ref_left = 0; r->tok_left = 0;
+}
+
+char cmd_next(CmdReader *r) {
+    if (r->ret >= 0 && r->ref_left == 0) { r->pos = r->ret; r->ret = -1; r->tok_left = 0; }
+    while (r->tok_left == 0) {
+        if (r->pos >= r->len) return 0;
+        uint8_t b = r->p[r->pos++];
+        if (b & 0x80) {
+            if (r->ret >= 0 || r->pos >= r->len) return 0;
+            int to = r->p[r->pos++];
+            if (to >= r->pos - 2) return 0;
+            r->ref_left = (b & 0x7F) + CMD_REF_MIN;
+            r->ret = r->pos; r->pos = to;
+            continue;
+        }
+        r->tok = b;
+        r->tok_left = (b & 0x40) ? (b & 0x0F) + 1 : 3;
+    }
+    int op = (r->tok & 0x40) ? (r->tok >> 4) & 3 : (r->tok >> (2 * (r->tok_left - 1))) & 3;
+    r->tok_left--;
+    if (r->ret >= 0) r->ref_left--;
+    return "F+-."[op];
+}
+
+// Pomiar szybkości do REGISTER: kwadraty 8x8 w pustym regionie MAX_REGION x MAX_REGION.
+// Zwraca tysiące komend na sekundę (co najmniej 1 - 0 znaczyłoby "nie zmierzono").
+uint16_t measure_kcps() {
+    rx = ry = 0; rw = rh = MAX_REGION;
+    Turtle t = { (MAX_REGION / 2) * FX_ONE + FX_ONE / 2, (MAX_REGION / 2) * FX_ONE + FX_ONE / 2, 0, 0 };
+    uint32_t t0 = micros();
+    int cmds = 0;
+    for(; cmds < 252; cmds++) {
+        if(cmds % 9 == 8) turtle_turn(&t, 90);
+        else turtle_forward(&t);
+    }
+    uint32_t us = micros() - t0;
+    rw = rh = 0;
+    memset(grid, '.', sizeof(grid));
+    uint32_t kcps = us ? (uint32_t)cmds * 1000 / us : 0xFFFF;
+    return kcps < 1 ? 1 : kcps > 0xFFFF ? 0xFFFF : kcps;
+}
+
 uint16_t readTemperature() {
     return ZsutAnalog5Read();
 }
@@ -64,21 +268,39 @@ void setup(){
     Serial.print(" Port: "); Serial.println(LOCAL_PORT);
     
     memset(grid, '.', sizeof(grid));
+    turtle_init();
+    kcps = measure_kcps();
+    Serial.print("Speed: "); Serial.print(kcps); Serial.println(" kcmd/s");
+    // Rejestracja w loop(): serwer przyjmuje nody także po starcie zadania
+}
 
-    // Rejestracja (wysyłamy kilka razy dla pewności w setupie, ale serwer obsłuży duplikaty)
-    for(int i=0; i<3; i++){
-        uint8_t buf[8];
-        pack_header(buf, MSG_REGISTER, 0, 0);
-        buf[5] = alp_crc(buf, 5);
-        Udp.beginPacket(SERVER_IP, SERVER_PORT);
-        Udp.write(buf, 6);
-        Udp.endPacket();
-        delay(200);
-    }
+void send_register(){
+    // payload (Common/caps.h): bufor odbiorczy(2) komórki siatki(2) kodowania(1) kcmd/s(2)
+    // - serwer dobiera do nich rozmiar chunków
+    uint8_t buf[16];
+    pack_header(buf, MSG_REGISTER, 0, 7);
+    buf[5] = (BUF_SIZE >> 8) & 0xFF; buf[6] = BUF_SIZE & 0xFF;
+    buf[7] = (sizeof(grid) >> 8) & 0xFF; buf[8] = sizeof(grid) & 0xFF;
+    buf[9] = 0x03;      // literały/powtórzenia i referencje - dekoder niżej ma wszystko
+    buf[10] = kcps >> 8; buf[11] = kcps & 0xFF;
+    buf[12] = alp_crc(buf, 12);
+    Udp.beginPacket(SERVER_IP, SERVER_PORT);
+    Udp.write(buf, 13);
+    Udp.endPacket();
+}
+
+void send_heartbeat(){
+    uint8_t b[6]; pack_header(b, MSG_HEARTBEAT, 0, 0); b[5]=alp_crc(b,5);
+    Udp.beginPacket(SERVER_IP, SERVER_PORT); Udp.write(b,6); Udp.endPacket();
 }
 
 void loop(){
     uint8_t buf[BUF_SIZE];
+    // REGISTER aż do ACK (ponowiony po restarcie mówi serwerowi, że siatka przepadła), potem HEARTBEAT
+    unsigned long now = millis();
+    if(!registered && now - reg_last >= REGISTER_MS){ send_register(); reg_last = now; }
+    if(registered && now - hb_last >= HEARTBEAT_MS){ send_heartbeat(); hb_last = now; }
+
     int packetSize = Udp.parsePacket();
     
     if(packetSize > 0){
@@ -87,14 +309,19 @@ void loop(){
         uint8_t seq = buf[1];
         int len = (buf[3] << 8) | buf[4];
 
-        if(type == MSG_ASSIGN){
+        if(type == MSG_ACK){
+            if(!registered) Serial.println("REGISTERED");
+            registered = true;
+        }
+        else if(type == MSG_ASSIGN){
+            registered = true;      // ACK na REGISTER mógł zginąć
             rx = buf[5]; ry = buf[6]; rw = buf[7]; rh = buf[8];
             
             int16_t ang = (buf[9] << 8) | buf[10];
             int16_t stp = (buf[11] << 8) | buf[12];
             
-            turn_angle = (double)ang;
-            move_step = (double)stp / 100.0;
+            turn_angle = ang;
+            move_step = (int32_t)stp * FX_ONE / 100;
             configured = true;
 
             Serial.print("ASSIGNED: "); Serial.print(rx); Serial.print(","); Serial.println(ry);
@@ -104,74 +331,36 @@ void loop(){
             Udp.beginPacket(SERVER_IP, SERVER_PORT); Udp.write(b,6); Udp.endPacket();
         }
         else if(type == MSG_DATA){
-            int16_t sx = (buf[5]<<8)|buf[6];
-            int16_t sy = (buf[7]<<8)|buf[8];
-            int16_t sa = (buf[9]<<8)|buf[10];
+            Turtle t;
+            turtle_get(&buf[5], &t);
 
-            double cx = sx/100.0; 
-            double cy = sy/100.0; 
-            int ca = sa;
-            
-            int cmds_len = len - 6;
+            // [17..18] liczba komend, [19..] skompresowane komendy (bez nawiasów - obsługuje je serwer)
+            int cmds_count = (buf[17] << 8) | buf[18];
+            CmdReader cr;
+            cmd_reader(&cr, &buf[19], len - 14);
             int steps_done = 0;
+            bool exited = false;
 
-            for(int i=0; i<cmds_len; i++){
-                char cmd = buf[11+i];
-                if(cmd=='F'){ 
-                    int ix = (int)round(cx); 
-                    int iy = (int)round(cy);
-                    
-                    bool inside = false;
-                    if(configured) {
-                         int local_x = ix - rx;
-                         int local_y = iy - ry;
-                         if(local_x >= 0 && local_x < rw && local_y >= 0 && local_y < rh) {
-                             inside = true;
-                         }
-                    }
-
-                    if(!inside && steps_done > 0) { 
-                        break; 
-                    }
-
-                    if(inside) {
-                        grid[(int)round(cy) - ry][(int)round(cx) - rx] = '#';
-                    }
-
-                    // Ruch żółwia
-                    double rad = (double)ca * 3.14159265 / 180.0;
-                    cx += move_step * cos(rad); 
-                    cy += move_step * sin(rad); 
-                    
-                    steps_done++;
-                }
-                else if(cmd=='+') { 
-                    ca = (ca + (int)turn_angle) % 360;
-                    steps_done++;
-                }
-                else if(cmd=='-') { 
-                    ca = ca - (int)turn_angle;
-                    if(ca < 0) ca += 360;
-                    steps_done++;
-                }
+            // Najpierw reszta F przerwanego na granicy u sąsiada
+            if(t.rem) exited = turtle_forward(&t);
+
+            while(steps_done < cmds_count && !exited){
+                char cmd = cmd_next(&cr);
+                if(cmd == 0) break;
+                steps_done++;
+                if(cmd=='F') exited = turtle_forward(&t);
+                else if(cmd=='+') turtle_turn(&t, turn_angle);
+                else if(cmd=='-') turtle_turn(&t, -turn_angle);
             }
 
             uint8_t r[32]; 
-            pack_header(r, MSG_HANDOVER, seq, 7);
-            
-            int16_t nx=(int16_t)(cx*100); 
-            int16_t ny=(int16_t)(cy*100); 
-            int16_t na=(int16_t)ca;
-            
-            r[5]=(nx>>8)&0xFF; r[6]=nx&0xFF;
-            r[7]=(ny>>8)&0xFF; r[8]=ny&0xFF;
-            r[9]=(na>>8)&0xFF; r[10]=na&0xFF;
-            
-            r[11] = (uint8_t)steps_done;
-            
-            r[12]=alp_crc(r,12);
+            pack_header(r, MSG_HANDOVER, seq, 14);
+            turtle_put(&r[5], &t);
+            r[17] = (steps_done >> 8) & 0xFF;
+            r[18] = steps_done & 0xFF;
+            r[19] = alp_crc(r,19);
             
-            Udp.beginPacket(SERVER_IP, SERVER_PORT); Udp.write(r,13); Udp.endPacket();
+            Udp.beginPacket(SERVER_IP, SERVER_PORT); Udp.write(r,20); Udp.endPacket();
         }
         else if(type == MSG_REQ_COORDS){
             Serial.println("REQ: Origin Coords requested.");
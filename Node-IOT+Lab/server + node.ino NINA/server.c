@@ -8,18 +8,31 @@
 #include <stdint.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+
+#include "../../Common/turtle.h"
+#include "../../Common/cmdstream.h"
+#include "../../Common/frag.h"
+#include "../../Common/span.h"
+#include "../../Common/caps.h"
 
 // --- KONFIGURACJA ---
 #define PORT 8000
 #define NODE_COUNT 4
 #define GRID_SIZE 40        
 #define NODE_GRID_SIZE 20   
-#define CHUNK_SIZE 10       // 1 znak na raz dla precyzji (można zwiększyć)
+#define CHUNK_MAX_CMDS 4096 // górna granica komend w jednym chunku
+#define DEFAULT_RXBUF 256   // bufor noda, który go nie podał w REGISTER
 #define MAX_RETRIES 30      // Było 5 -> dajmy 20
-#define TIMEOUT_USEC 1000000 // 300ms timeout
+#define TIMEOUT_USEC 1000000 // 1 s na odpowiedź, potem ponowienie
+#define LIVENESS_USEC 2000000 // node milczący (bez HEARTBEAT i odpowiedzi) tak długo uznany za martwy
+#define START_GRACE_USEC 1000000 // po kworum start, gdy przez tyle nikt nowy się nie zgłosił
+
+#define MAX_STACK 64         // głębokość stosu żółwia dla [ ]
+#define MAX_STANDBY 2        // zapasowe nody (NODE_ID 5, 6) przejmujące region padniętego noda
+#define CKPT_CHUNKS 64       // co tyle chunków serwer pobiera siatki nodów (checkpoint)
 
 #define MAX_L_SYSTEM_SIZE 1000000 
-#define MY_PI 3.14159265358979323846
 
 #define ALP_VERSION 1
 #define MSG_REGISTER 0x1
@@ -31,13 +44,26 @@
 #define MSG_HANDOVER 0x7
 #define MSG_REQ_COORDS  0x8
 #define MSG_RESP_COORDS 0x9
+#define MSG_HEARTBEAT   0xC
 
 typedef struct {
     uint8_t id;             
     struct sockaddr_in addr;
     int active;
+    int dgram;              // największy datagram dla noda: min(bufor odbiorczy, MTU ścieżki)
+    int assigned;           // ASSIGN potwierdzony
+    int local;              // slot bez noda (padł albo nie zdążył na start) - region rysuje serwer
+    int enc;                // CAPS_ENC_*: czym node dekoduje strumień komend
+    int kcps;               // zmierzona szybkość, tysiące komend/s (0 = nie podał)
+    struct timeval seen;    // ostatni datagram od noda
 } Node;
 
+// Wykonany chunk: stan żółwia przed nim i zakres komend wystarczą, żeby go narysować jeszcze raz
+typedef struct {
+    int cursor, count;
+    Turtle t;
+} Done;
+
 typedef struct {
     char axiom[256];
     char ruleF[256];
@@ -51,11 +77,20 @@ typedef struct {
 } LSystemConfig;
 
 Node nodes[NODE_COUNT];
+Node standby[MAX_STANDBY];
+int standby_count = 0;
+Done *done_log = NULL;
+int log_count = 0, log_cap = 0;
+int ckpt_covers[NODE_COUNT];   // siatka noda (scalona z global_grid) zawiera done_log[0..covers)
+int chunks_since_ckpt = 0;
 char global_grid[GRID_SIZE][GRID_SIZE];
 uint8_t global_seq = 0;
 LSystemConfig config; 
 char *gen_current = NULL;
 char *gen_next = NULL;
+int reg_cnt = 0;
+int quorum = NODE_COUNT / 2 + 1;   // ALP_QUORUM: od ilu nodów wolno zacząć
+struct timeval last_join;
 
 // --- NARZĘDZIA SIECIOWE ---
 
@@ -84,8 +119,82 @@ void flush_socket(int sock) {
     fcntl(sock, F_SETFL, flags);
 }
 
+long elapsed_usec(struct timeval *t) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - t->tv_sec) * 1000000L + (now.tv_usec - t->tv_usec);
+}
+
+// Każdy datagram od noda (także HEARTBEAT, który node wysyła co pół sekundy) znaczy, że żyje
+void note_alive(struct sockaddr_in *from) {
+    for(int i=0; i<NODE_COUNT; i++)
+        if(nodes[i].active && nodes[i].addr.sin_addr.s_addr == from->sin_addr.s_addr && nodes[i].addr.sin_port == from->sin_port)
+            gettimeofday(&nodes[i].seen, NULL);
+    for(int i=0; i<standby_count; i++)
+        if(standby[i].addr.sin_addr.s_addr == from->sin_addr.s_addr && standby[i].addr.sin_port == from->sin_port)
+            gettimeofday(&standby[i].seen, NULL);
+}
+
+// REGISTER od noda: zapamiętuje adres i rozmiar datagramu, odsyła ACK. Zwraca indeks slotu lub -1.
+// Node może się zgłosić w każdej chwili. Node o ID 1..NODE_COUNT zajmuje swój slot, jeśli ten jest
+// wolny (slot, który rysuje serwer, przejmie przy najbliższym checkpoincie); pozostałe czekają jako
+// zapasowe na failover. REGISTER od noda, który dostał już ASSIGN, to restart - jego siatka przepadła.
+int register_node(int sock, uint8_t *buf, int n, struct sockaddr_in *caddr) {
+    int nid = buf[2];
+    if(nid < 1 || nid > NODE_COUNT + MAX_STANDBY) return -1;
+    // payload REGISTER: możliwości noda (Common/caps.h)
+    Caps caps;
+    int plen = (buf[3] << 8) | buf[4];
+    caps_get(&buf[5], plen < n - 6 ? plen : n - 6, DEFAULT_RXBUF, NODE_GRID_SIZE * NODE_GRID_SIZE, &caps);
+    if(caps.cells < NODE_GRID_SIZE * NODE_GRID_SIZE || !(caps.enc & CAPS_ENC_STREAM)) {
+        printf("Node %d cannot take a region (%d cells, encodings %x) - ignored.\n", nid, caps.cells, caps.enc);
+        return -1;
+    }
+    // Mniejszy datagram nie zmieści komend obok nagłówka DATA (20 B) - próg jak dla MTU (Common/frag.h)
+    int mtu = path_mtu(caddr), dgram = caps.rxbuf < mtu ? caps.rxbuf : mtu;
+    if(dgram < MIN_DGRAM) {
+        printf("Node %d takes only %d-byte datagrams - ignored.\n", nid, dgram);
+        return -1;
+    }
+    int slot = -1;
+    Node *nd = NULL;
+    for(int i=0; i<NODE_COUNT; i++) if(nodes[i].active && nodes[i].id == nid) slot = i;
+    for(int i=0; i<standby_count; i++) if(standby[i].id == nid) nd = &standby[i];
+    if(slot >= 0 && nodes[slot].assigned) {
+        // failover() odda mu region z powtórką od checkpointu
+        printf("Node %d restarted - region %d will be drawn again.\n", nid, slot);
+        nodes[slot].assigned = 0;
+    }
+    if(slot < 0 && !nd && nid <= NODE_COUNT && !nodes[nid-1].active) slot = nid - 1;
+    if(slot >= 0) nd = &nodes[slot];
+    else if(!nd) {
+        if(standby_count == MAX_STANDBY) { printf("Node %d: no free slot - ignored.\n", nid); return -1; }
+        nd = &standby[standby_count++];
+    }
+    int local = nd->local, fresh = !nd->active;
+    memset(nd, 0, sizeof(*nd));
+    nd->id = nid;
+    nd->addr = *caddr;
+    nd->active = 1;
+    nd->local = local;
+    nd->dgram = dgram;
+    nd->enc = caps.enc;
+    nd->kcps = caps.kcps;
+    gettimeofday(&nd->seen, NULL);
+    gettimeofday(&last_join, NULL);
+    if(slot >= 0 && fresh) reg_cnt++;
+    printf("Node %d registered%s (rx buffer %d, path MTU %d, %d kcmd/s).\n", nid, slot < 0 ? " as standby" : "", caps.rxbuf, mtu, caps.kcps);
+
+    uint8_t ack[6];
+    pack_header(ack, MSG_ACK, buf[1], 0, 0);
+    ack[5]=calc_crc(ack,5);
+    sendto(sock, ack, 6, 0, (struct sockaddr*)caddr, sizeof(*caddr));
+    return slot;
+}
+
 // UNIWERSALNA FUNKCJA NIEZAWODNEGO WYSYŁANIA (Stop-and-Wait)
-// Zwraca: długość odebranych danych w buf lub -1 jeśli błąd
+// Zwraca: długość odebranych danych w buf lub -1 jeśli błąd.
+// Nie czeka pełnych MAX_RETRIES na noda, który milczy dłużej niż LIVENESS_USEC albo się zrestartował.
 int send_reliable(int sock, int node_idx, uint8_t *packet, int packet_len, 
                   int expected_type, uint8_t *recv_buf, int recv_buf_max) {
     
@@ -93,32 +202,50 @@ int send_reliable(int sock, int node_idx, uint8_t *packet, int packet_len,
     socklen_t flen = sizeof(from);
     struct timeval tv;
     int target_id = nodes[node_idx].id;
+    if(!nodes[node_idx].assigned && expected_type != MSG_ACK) return -1;   // restart: bez ASSIGN node nic nie narysuje
 
     for(int attempt = 0; attempt < MAX_RETRIES; attempt++) {
         // 1. Wyślij
         sendto(sock, packet, packet_len, 0, 
                (struct sockaddr*)&nodes[node_idx].addr, sizeof(nodes[node_idx].addr));
+        struct timeval sent;
+        gettimeofday(&sent, NULL);
 
         // 2. Czekaj na odpowiedź (timeout)
-        tv.tv_sec = 0;
-        tv.tv_usec = TIMEOUT_USEC;
+        tv.tv_sec = TIMEOUT_USEC / 1000000;     // tv_usec >= 1 s setsockopt odrzuca (EDOM)
+        tv.tv_usec = TIMEOUT_USEC % 1000000;
         setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
-        while(1) {
+        // Liczony od wysłania: HEARTBEATy innych nodów co chwilę przerywają recvfrom przed timeoutem gniazda
+        while(elapsed_usec(&sent) < TIMEOUT_USEC) {
             int n = recvfrom(sock, recv_buf, recv_buf_max, 0, (struct sockaddr*)&from, &flen);
             if (n < 0) break; // Timeout lub błąd
+            if (n >= 5) note_alive(&from);
 
             int type = recv_buf[0] & 0x0F;
-            uint8_t seq = recv_buf[1]; // Można sprawdzać seq, ale w prostym stop-wait wystarczy type
-            uint8_t nid = recv_buf[2];
+            uint8_t seq = recv_buf[1]; // node odsyła seq zapytania w ACK, HANDOVER, RESPONSE i RESP_COORDS
 
-            // Czy to odpowiedź od tego noda i tego typu co chcemy?
-            // Uwaga: MSG_HANDOVER przychodzi jako odpowiedź na DATA
-            if (type == expected_type) { // Tutaj można dodać sprawdzanie NID jeśli node je odsyła
+            // Rejestracja trwa równolegle z ASSIGN i pobieraniem współrzędnych - REGISTER nie może przepaść
+            if (type == MSG_REGISTER && expected_type != MSG_REGISTER) {
+                register_node(sock, recv_buf, n, &from);
+                if (!nodes[node_idx].assigned && expected_type != MSG_ACK) return -1;
+                continue;
+            }
+            // Czy to odpowiedź od tego noda, tego typu i na to zapytanie?
+            // Uwaga: MSG_HANDOVER przychodzi jako odpowiedź na DATA; spóźniona odpowiedź na
+            // wcześniejsze zapytanie (inny seq) albo pakiet od innego noda jest pomijany
+            if (type == expected_type && seq == packet[1] &&
+                from.sin_addr.s_addr == nodes[node_idx].addr.sin_addr.s_addr &&
+                from.sin_port == nodes[node_idx].addr.sin_port) {
                 return n; // SUKCES
             }
         }
+        if (elapsed_usec(&nodes[node_idx].seen) > LIVENESS_USEC) {
+            printf("ERROR: Node %d silent for %ld ms.\n", target_id, elapsed_usec(&nodes[node_idx].seen) / 1000);
+            return -1;
+        }
         printf("WARN: Node %d no response (attempt %d/%d). Retrying...\n", target_id, attempt+1, MAX_RETRIES);
+        span_instant("retry", 1 + node_idx, attempt + 1);
     }
     printf("ERROR: Node %d unreachable after retries.\n", target_id);
     return -1;
@@ -126,9 +253,10 @@ int send_reliable(int sock, int node_idx, uint8_t *packet, int packet_len,
 
 // --- LOGIKA APLIKACJI ---
 
-int get_node_index(double x, double y) {
-    int col = (int)((x + 0.5) / NODE_GRID_SIZE);
-    int row = (int)((y + 0.5) / NODE_GRID_SIZE);
+// Komórka (cx,cy) -> indeks noda; pozycję żółwia na komórkę zamienia turtle_cell()
+int get_node_index(int cx, int cy) {
+    int col = cx / NODE_GRID_SIZE;
+    int row = cy / NODE_GRID_SIZE;
     
     // Zabezpieczenia granic (bez zmian)
     if (col < 0) col = 0; if (col > 1) col = 1;
@@ -138,7 +266,8 @@ int get_node_index(double x, double y) {
 }
 
 void fetch_origin_coordinates(int sock) {
-    int node_idx = get_node_index(config.start_x, config.start_y);
+    SPAN("fetch_origin_coordinates");
+    int node_idx = get_node_index((int)config.start_x, (int)config.start_y);
     
     if(nodes[node_idx].active == 0) {
         printf("WARN: Origin Node (Index %d) determined from config is NOT active! Using defaults.\n", node_idx);
@@ -185,6 +314,7 @@ void fetch_origin_coordinates(int sock) {
 }
 
 void load_config() {
+    SPAN("load_config");
     // Domyślne wartości
     strcpy(config.axiom, "F-F-F-F");
     strcpy(config.ruleF, "F-F+F+FF-F-F+F"); 
@@ -218,7 +348,14 @@ void load_config() {
             // Trim leading spaces
             while(config.ruleF[0] == ' ') memmove(config.ruleF, config.ruleF+1, strlen(config.ruleF));
         }
-        // ... (analogicznie dla X i Y jeśli potrzebne)
+        if(strncmp(line, "ruleX:", 6) == 0) {
+            char *p = strchr(line, ':'); if(p) strcpy(config.ruleX, p+1);
+            while(config.ruleX[0] == ' ') memmove(config.ruleX, config.ruleX+1, strlen(config.ruleX));
+        }
+        if(strncmp(line, "ruleY:", 6) == 0) {
+            char *p = strchr(line, ':'); if(p) strcpy(config.ruleY, p+1);
+            while(config.ruleY[0] == ' ') memmove(config.ruleY, config.ruleY+1, strlen(config.ruleY));
+        }
     }
     fclose(f);
     printf("Config: Axiom='%s', Iters=%d, Start=%.1f,%.1f, Angle=%.1f\n", 
@@ -226,6 +363,7 @@ void load_config() {
 }
 
 void generate_lsystem() {
+    SPAN("generate_lsystem");
     if(gen_current) free(gen_current);
     if(gen_next) free(gen_next);
     
@@ -269,105 +407,399 @@ void generate_lsystem() {
     }
 }
 
-void run_simulation(int sock) {
-    char *full_string = gen_current;
-    int cursor = 0;
-    int total_len = strlen(full_string);
-    if(total_len == 0) return;
+// --- ODZYSKIWANIE PO AWARII NODA ---
 
-    double cur_x = config.start_x;
-    double cur_y = config.start_y;
-    double cur_angle = 0.0; 
+void log_done(int cursor, int count, const Turtle *t) {
+    if(log_count == log_cap) {
+        log_cap = log_cap ? 2 * log_cap : 1024;
+        done_log = (Done*)realloc(done_log, log_cap * sizeof(Done));
+        if(!done_log) { printf("Alloc fail\n"); exit(1); }
+    }
+    Done *d = &done_log[log_count++];
+    d->cursor = cursor; d->count = count; d->t = *t;
+}
 
-    uint8_t buf[1024];
+// Region noda w slocie i (układ 2x2 - region należy do slotu, nie do ID noda)
+void node_region(int i, int *x0, int *y0) {
+    *x0 = (i % 2) * NODE_GRID_SIZE;
+    *y0 = (i / 2) * NODE_GRID_SIZE;
+}
 
-    printf("Starting simulation...\n");
-    flush_socket(sock); 
+// RESPONSE z siatką noda: komórki '#' dopisywane do global_grid (OR - checkpointy i końcowy odczyt się sumują)
+int collect_node(int sock, int i) {
+    uint8_t req[6], buf[1200];
+    global_seq++;
+    pack_header(req, MSG_REQUEST, global_seq, nodes[i].id, 0);
+    req[5] = calc_crc(req, 5);
+    int n = send_reliable(sock, i, req, 6, MSG_RESPONSE, buf, sizeof(buf));
+    if(n <= 0) return 0;
+
+    int off_x, off_y;
+    node_region(i, &off_x, &off_y);
+    int ptr = 5; // Payload start
+    for(int y=0; y<NODE_GRID_SIZE; y++) {
+        for(int x=0; x<NODE_GRID_SIZE; x++) {
+            if(ptr < n && buf[ptr] == '#') global_grid[off_y + y][off_x + x] = '#';
+            ptr++;
+        }
+    }
+    return 1;
+}
+
+// Krok tak, jak idzie w ASSIGN (setne części) - serwer liczy nim to samo co node
+int16_t wire_step(void) { return (int16_t)(config.step * 100); }
+int32_t fx_step(void) { return (int32_t)wire_step() * FX_ONE / 100; }
+
+// ASSIGN dla noda w slocie i: region, kąt i krok; czeka na ACK
+int assign_node(int sock, int i, uint8_t *buf, int buf_max) {
+    uint64_t t0 = span_now();
+    uint8_t msg[32]; 
+    global_seq++;
+    pack_header(msg, MSG_ASSIGN, global_seq, nodes[i].id, 8);
+    
+    // Obliczamy parametry dla noda
+    int x0, y0;
+    node_region(i, &x0, &y0);
+    
+    msg[5] = x0; msg[6] = y0; 
+    msg[7] = NODE_GRID_SIZE; msg[8] = NODE_GRID_SIZE; 
+    
+    int16_t ang = (int16_t)config.angle_deg;
+    int16_t stp = wire_step();
+    
+    msg[9] = (ang >> 8) & 0xFF; msg[10] = ang & 0xFF;
+    msg[11] = (stp >> 8) & 0xFF; msg[12] = stp & 0xFF;
+    
+    msg[13] = calc_crc(msg, 13);
+    
+    // WYŚLIJ I CZEKAJ NA ACK
+    printf("Sending ASSIGN to Node %d...\n", nodes[i].id);
+    int res = send_reliable(sock, i, msg, 14, MSG_ACK, buf, buf_max);
+    if(res < 0) {
+        printf("Failed to configure Node %d!\n", nodes[i].id);
+    } else {
+        printf("Node %d configured (ACK received).\n", nodes[i].id);
+    }
+    span_complete("assign", t0, 1 + i, res > 0);
+    return res > 0;
+}
+
+int run_span(int sock, int cursor, int end, Turtle cur);
+
+// Chunk dla regionu, który rysuje serwer: to samo co node robi z MSG_DATA, odpowiedź jak HANDOVER
+void plot_global(int cx, int cy, void *ctx) {
+    (void)ctx;
+    if(cx >= 0 && cx < GRID_SIZE && cy >= 0 && cy < GRID_SIZE) global_grid[cy][cx] = '#';
+}
+
+int run_local(int i, uint8_t *packet, uint8_t *resp) {
+    int x0, y0;
+    node_region(i, &x0, &y0);
+    int32_t step = fx_step();
+    int angle = (int)config.angle_deg;
+    Turtle t;
+    turtle_get(&packet[5], &t);
+    int count = (packet[17] << 8) | packet[18];
+    int len = ((packet[3] << 8) | packet[4]) - 14;
+    CmdReader cr;
+    cmd_reader(&cr, &packet[19], len);
+
+    int done = 0, exited = 0;
+    if(t.rem) exited = turtle_forward(&t, step, x0, y0, x0 + NODE_GRID_SIZE, y0 + NODE_GRID_SIZE, plot_global, NULL);
+    while(done < count && !exited) {
+        char c = cmd_next(&cr);
+        if(c == 0) break;
+        done++;
+        if(c == 'F') exited = turtle_forward(&t, step, x0, y0, x0 + NODE_GRID_SIZE, y0 + NODE_GRID_SIZE, plot_global, NULL);
+        else if(c == '+') turtle_turn(&t, angle);
+        else if(c == '-') turtle_turn(&t, -angle);
+    }
+    turtle_put(&resp[5], &t);
+    resp[17] = (done >> 8) & 0xFF; resp[18] = done & 0xFF;
+    return 20;
+}
+
+// Czy ruch (reszta albo całe F) dotyka regionu [x0,x1)x[y0,y1)?
+int move_touches(const Turtle *t, int32_t step, int x0, int y0, int x1, int y1) {
+    int32_t dx, dy, t0, t1;
+    int in_side;
+    turtle_vector(t, step, &dx, &dy);
+    return rast_clip(t->x, t->y, dx, dy, x0, y0, x1, y1, &t0, &t1, &in_side) >= 0;
+}
+
+void add_redo(Done **redo, int *n, int *cap, int from, int to, const Turtle *t) {
+    if(*n == *cap) {
+        *cap = *cap ? 2 * *cap : 64;
+        *redo = (Done*)realloc(*redo, *cap * sizeof(Done));
+        if(!*redo) { printf("Alloc fail\n"); exit(1); }
+    }
+    (*redo)[*n].cursor = from; (*redo)[*n].count = to - from; (*redo)[*n].t = *t;
+    (*n)++;
+}
+
+// Najszybszy zapasowy node trafia do slotu i. Zwraca 0, gdy zapasowych brak.
+int take_standby(int i) {
+    if(standby_count == 0) return 0;
+    int best = 0;
+    for(int k=1; k<standby_count; k++) if(standby[k].kcps > standby[best].kcps) best = k;
+    nodes[i] = standby[best];
+    standby[best] = standby[--standby_count];
+    return 1;
+}
+
+void name_lane(int i) {
+    char lane[24];
+    if(nodes[i].local) snprintf(lane, sizeof(lane), "Server (region %d)", i);
+    else snprintf(lane, sizeof(lane), "Node %d", nodes[i].id);
+    span_lane(1 + i, lane);
+}
+
+// Region slotu i traci noda: przejmuje go zapasowy node (albo serwer, gdy zapasowych brak);
+// node, który się zrestartował, dostaje swój region z powrotem.
+// Potem rysowane są jeszcze raz tylko te fragmenty chunków od ostatniego checkpointu tego noda,
+// których ruchy F dotykają regionu - koszt zależy od utraconej pracy, nie od całego zadania.
+void failover(int sock, int i) {
+    SPAN("failover");
+    uint8_t buf[256];
+    int from = ckpt_covers[i];
+    int lost_id = nodes[i].id;
+    int restarted = nodes[i].active && !nodes[i].assigned;
+
+    nodes[i].assigned = 0;
+    while(!nodes[i].local && !nodes[i].assigned) {
+        if(restarted) restarted = 0;
+        else if(!take_standby(i)) {
+            printf("Node %d lost, no standby left: server draws region %d itself.\n", lost_id, i);
+            nodes[i].local = 1;
+            nodes[i].active = 0;     // slot wolny - zgłoszony później node przejmie go na checkpoincie
+            break;
+        }
+        else printf("Node %d lost: standby Node %d takes over its region.\n", lost_id, nodes[i].id);
+        nodes[i].assigned = assign_node(sock, i, buf, sizeof(buf));
+    }
+    name_lane(i);
+    ckpt_covers[i] = log_count;
+
+    // Odcinki do powtórki: od stanu przed pierwszym F dotykającym regionu do ostatniego takiego F
+    int x0, y0;
+    node_region(i, &x0, &y0);
+    int x1 = x0 + NODE_GRID_SIZE, y1 = y0 + NODE_GRID_SIZE;
+    int32_t step = fx_step();
+    int angle = (int)config.angle_deg;
+    int end_log = log_count, spans = 0, cap = 0, cmds = 0;
+    Done *redo = NULL;
+    for(int e=from; e<end_log; e++) {
+        Done d = done_log[e];
+        Turtle t = d.t, at = t;
+        int open = -1, last = 0;
+        if(t.rem) {
+            if(move_touches(&t, step, x0, y0, x1, y1)) open = last = d.cursor;
+            turtle_advance(&t, step);
+        }
+        for(int k=d.cursor; k<d.cursor + d.count; k++) {
+            char c = gen_current[k];
+            if(c=='+') turtle_turn(&t, angle);
+            else if(c=='-') turtle_turn(&t, -angle);
+            if(c!='F') continue;
+            if(move_touches(&t, step, x0, y0, x1, y1)) {
+                if(open < 0) { open = k; at = t; }
+                last = k + 1;
+            } else if(open >= 0) {
+                add_redo(&redo, &spans, &cap, open, last, &at);
+                open = -1;
+            }
+            turtle_advance(&t, step);
+        }
+        if(open >= 0) add_redo(&redo, &spans, &cap, open, last, &at);
+    }
+    for(int k=0; k<spans; k++) cmds += redo[k].count;
+    printf("Replaying %d commands in %d spans (log %d..%d) for region %d\n", cmds, spans, from, end_log, i);
+    for(int k=0; k<spans; k++) run_span(sock, redo[k].cursor, redo[k].cursor + redo[k].count, redo[k].t);
+    free(redo);
+}
+
+// Slot, który rysuje serwer, dostaje noda: własnego, który zgłosił się po starcie, albo zapasowego.
+// To, co serwer już narysował, jest w global_grid, więc node zaczyna od pustej siatki bez powtórki.
+void join_slot(int sock, int i) {
+    uint8_t buf[256];
+    if(!nodes[i].active && !take_standby(i)) return;
+    nodes[i].local = 0;
+    if(!assign_node(sock, i, buf, sizeof(buf))) {
+        nodes[i].local = 1;
+        nodes[i].active = 0;
+        return;
+    }
+    nodes[i].assigned = 1;
+    ckpt_covers[i] = log_count;
+    printf("\nNode %d joins: takes region %d over from the server.\n", nodes[i].id, i);
+    name_lane(i);
+}
+
+// Co CKPT_CHUNKS chunków: siatki nodów, które od ostatniego razu pracowały, trafiają do global_grid,
+// a sloty rysowane przez serwer dostają nody zgłoszone w międzyczasie
+void checkpoint(int sock) {
+    SPAN("checkpoint");
+    chunks_since_ckpt = 0;
+    for(int i=0; i<NODE_COUNT; i++) {
+        if(nodes[i].local) { join_slot(sock, i); continue; }
+        if(!nodes[i].assigned) { failover(sock, i); continue; }
+        if(ckpt_covers[i] == log_count) continue;
+        int at = log_count;
+        if(collect_node(sock, i)) ckpt_covers[i] = at;
+        else failover(sock, i);
+    }
+}
 
+// Komendy [cursor, end) od stanu cur. Zwraca liczbę wysłanych chunków.
+int run_span(int sock, int cursor, int end, Turtle cur) {
+    char *full_string = gen_current;
+    int32_t step = fx_step();
+    uint8_t buf[1024];
     int steps_done = 0;
+    Turtle stack[MAX_STACK];
+    int sp = 0;
+
+    // cur.rem != 0: ostatnie F przekroczyło granicę regionu, resztę rysuje sąsiad
+    while (cursor < end || cur.rem) {
+        // Nawiasy obsługuje serwer - stan żółwia przy '[' / ']' jest znany tylko tutaj
+        char c = cursor < end ? full_string[cursor] : 0;
+        if (!cur.rem && c == '[') {
+            if (sp < MAX_STACK) stack[sp++] = cur;
+            else printf("\nWARN: Turtle stack overflow at %d\n", cursor);
+            cursor++;
+            continue;
+        }
+        if (!cur.rem && c == ']') {
+            if (sp > 0) cur = stack[--sp];
+            cursor++;
+            continue;
+        }
+
+        int cx, cy;
+        turtle_cell(&cur, step, &cx, &cy);
+        if (cx < 0 || cx >= GRID_SIZE || cy < 0 || cy >= GRID_SIZE) {
+            // Poza płótnem nie ma noda - serwer liczy ruch sam, do wejścia na płótno
+            if (!cur.rem) {
+                if (c == '+') { turtle_turn(&cur, (int)config.angle_deg); cursor++; continue; }
+                if (c == '-') { turtle_turn(&cur, -(int)config.angle_deg); cursor++; continue; }
+                cursor++;
+                if (c != 'F') continue;
+            }
+            if (!turtle_enter(&cur, step, 0, 0, GRID_SIZE, GRID_SIZE)) turtle_advance(&cur, step);
+            continue;
+        }
 
-    while (cursor < total_len) {
-        int node_idx = get_node_index(cur_x, cur_y);
+        int node_idx = get_node_index(cx, cy);
         int target_id = nodes[node_idx].id;
 
-        int chunk_len = CHUNK_SIZE; 
+        // Chunk kończy się przed najbliższym nawiasem
+        int span = 0;
+        while (span < CHUNK_MAX_CMDS && cursor + span < end) {
+            char cc = full_string[cursor + span];
+            if (cc == '[' || cc == ']') break;
+            span++;
+        }
         
+        // Nie więcej komend niż żółw zdąży wykonać przed wyjściem z regionu - node i tak
+        // zatrzymuje się na granicy, reszta chunka byłaby wysłana na darmo
+        int x0, y0;
+        node_region(node_idx, &x0, &y0);
+        int inside = turtle_span_inside(&full_string[cursor], span, cur, step, (int)config.angle_deg,
+                                        x0, y0, x0 + NODE_GRID_SIZE, y0 + NODE_GRID_SIZE);
+        if (inside < span) span = inside > 0 ? inside : 1;
+
+        // Wolny node (AVR) dostaje tyle komend, ile zrobi w ćwierć timeoutu
+        long most = (long)nodes[node_idx].kcps * TIMEOUT_USEC / 4000;
+        if (!nodes[node_idx].local && most > 0 && span > most) span = most;
+
+        // Tyle bajtów, ile zmieści bufor noda i MTU ścieżki
+        int budget = nodes[node_idx].local ? CMD_MAX_TOK : nodes[node_idx].dgram - 20;
+        if (budget > CMD_MAX_TOK) budget = CMD_MAX_TOK;
+
         global_seq++;
         uint8_t packet[512];
-        int payload_len = 6 + chunk_len; 
+
+        // DATA: [5..16] żółw, [17..18] liczba komend, [19..] skompresowane komendy
+        int chunk_len;
+        int refs = nodes[node_idx].local || (nodes[node_idx].enc & CAPS_ENC_REF);
+        int enc_len = cmd_encode(&full_string[cursor], span, &packet[19], budget, &chunk_len, refs);
+        int payload_len = 14 + enc_len; 
         
         pack_header(packet, MSG_DATA, global_seq, target_id, payload_len);
-
-        int16_t sx = (int16_t)(cur_x * 100);
-        int16_t sy = (int16_t)(cur_y * 100);
-        int16_t sa = (int16_t)(cur_angle);
-
-        packet[5] = (sx >> 8) & 0xFF; packet[6] = sx & 0xFF;
-        packet[7] = (sy >> 8) & 0xFF; packet[8] = sy & 0xFF;
-        packet[9] = (sa >> 8) & 0xFF; packet[10] = sa & 0xFF;
-
-        memcpy(&packet[11], &full_string[cursor], chunk_len);
-        packet[11+chunk_len] = calc_crc(packet, 11+chunk_len);
+        turtle_put(&packet[5], &cur);
+        packet[17] = (chunk_len >> 8) & 0xFF; packet[18] = chunk_len & 0xFF;
+        packet[19+enc_len] = calc_crc(packet, 19+enc_len);
 
         // --- NIEZAWODNE WYSYŁANIE CHUNKA ---
         // Oczekujemy MSG_HANDOVER jako potwierdzenia wykonania ruchu
-        int n = send_reliable(sock, node_idx, packet, 11+chunk_len+1, MSG_HANDOVER, buf, sizeof(buf));
+        uint64_t t0 = span_now();
+        int n = nodes[node_idx].local ? run_local(node_idx, packet, buf)
+                                      : send_reliable(sock, node_idx, packet, 19+enc_len+1, MSG_HANDOVER, buf, sizeof(buf));
+        span_complete("chunk", t0, 1 + node_idx, chunk_len);
         
         if (n > 0) {
-            // Sukces - odczytujemy nową pozycję z Handover
-            int16_t nx = (buf[5] << 8) | buf[6];
-            int16_t ny = (buf[7] << 8) | buf[8];
-            int16_t na = (buf[9] << 8) | buf[10];
-            uint8_t processed_count = buf[11];
-
-            cur_x = nx / 100.0;
-            cur_y = ny / 100.0;
-            cur_angle = (double)na;
+            // Sukces - odczytujemy nowy stan z Handover: [5..16] żółw, [17..18] liczba wykonanych znaków
+            uint16_t processed_count = (buf[17] << 8) | buf[18];
+            log_done(cursor, processed_count, &cur);
+            turtle_get(&buf[5], &cur);
             
             cursor += processed_count;
             steps_done++;
-            if(steps_done % 10 == 0) { printf("\rStep %d/%d", steps_done, total_len); fflush(stdout); }
+            if(steps_done % 10 == 0) { printf("\rStep %d/%d", steps_done, end); fflush(stdout); }
+            if(++chunks_since_ckpt >= CKPT_CHUNKS) checkpoint(sock);
         } else {
-            printf("\nCRITICAL ERROR: Lost connection with Node %d. Aborting.\n", target_id);
-            break;
+            // Ten sam chunk pójdzie jeszcze raz - już do noda, który przejął region
+            printf("\nNode %d lost at command %d.\n", target_id, cursor);
+            failover(sock, node_idx);
         }
     }
+    return steps_done;
+}
+
+void run_simulation(int sock) {
+    SPAN("simulation");
+    int total_len = strlen(gen_current);
+    if(total_len == 0) return;
+
+    // Stan żółwia w Q16.16 - ten sam kod geometrii co na nodach, więc pozycje zgadzają się co do bitu
+    Turtle cur = { FX(config.start_x), FX(config.start_y), 0, 0 };
+
+    printf("Starting simulation...\n");
+    flush_socket(sock); 
+    memset(global_grid, '.', sizeof(global_grid));
+    log_count = 0;
+    for(int i=0; i<NODE_COUNT; i++) ckpt_covers[i] = 0;
+    run_span(sock, 0, total_len, cur);
     printf("\nSimulation finished.\n");
 }
 
 void collect_results(int sock) {
+    SPAN("collect_results");
     printf("Requesting results...\n");
-    memset(global_grid, '.', sizeof(global_grid));
     flush_socket(sock); 
-    
-    uint8_t buf[1200]; 
 
     for(int i=0; i<NODE_COUNT; i++) {
-        uint8_t req[6]; 
-        global_seq++;
-        pack_header(req, MSG_REQUEST, global_seq, nodes[i].id, 0);
-        req[5] = calc_crc(req, 5);
+        if(nodes[i].local) continue;     // już w global_grid
         
         // --- NIEZAWODNE POBIERANIE WYNIKU ---
-        int n = send_reliable(sock, i, req, 6, MSG_RESPONSE, buf, sizeof(buf));
-        
-        if(n > 0) {
-            int idx = nodes[i].id - 1;
-            int off_x = (idx % 2) * NODE_GRID_SIZE;
-            int off_y = (idx / 2) * NODE_GRID_SIZE;
-
-            int ptr = 5; // Payload start
-            for(int y=0; y<NODE_GRID_SIZE; y++) {
-                for(int x=0; x<NODE_GRID_SIZE; x++) {
-                    if(buf[ptr] == '#') global_grid[off_y + y][off_x + x] = '#';
-                    ptr++;
-                }
-            }
-            printf("Node %d data merged.\n", nodes[i].id);
+        uint64_t t0 = span_now();
+        int got = nodes[i].assigned && collect_node(sock, i);
+        if(!got) {
+            // Node padł po ostatnim checkpoincie: jego część rysuje następca, potem odczyt jeszcze raz
+            failover(sock, i);
+            got = nodes[i].local || collect_node(sock, i);
         }
+        if(got) printf("Node %d data merged.\n", nodes[i].id);
+        span_complete("merge", t0, 1 + i, got);
     }
 }
 
+void *generate_worker(void *arg) {
+    (void)arg;
+    generate_lsystem();
+    return NULL;
+}
+
 int main() {
     int sock = socket(AF_INET, SOCK_DGRAM, 0);
     struct sockaddr_in saddr, caddr;
@@ -381,73 +813,71 @@ int main() {
     }
 
     load_config(); 
+    turtle_init();
+    const char *q = getenv("ALP_QUORUM");
+    if(q && atoi(q) > 0) quorum = atoi(q) < NODE_COUNT ? atoi(q) : NODE_COUNT;
 
-    printf("=== SERVER STARTED ===\nWaiting for %d nodes...\n", NODE_COUNT);
+    printf("=== SERVER STARTED ===\nWaiting for %d nodes (quorum %d)...\n", NODE_COUNT, quorum);
+
+    // ALP_SPANS=<plik.json>: czasy faz jako Chrome trace events (Common/span.h); tor 1+i = node i
+    span_lane(0, "server");
+    for(int i=0; i<NODE_COUNT; i++) { char lane[16]; snprintf(lane, sizeof(lane), "Node %d", i+1); span_lane(1+i, lane); }
+    uint64_t t0 = span_now();
 
     socklen_t clen = sizeof(caddr); 
     uint8_t buf[256];
-    int reg_cnt = 0;
     
     // Reset aktywności
-    for(int i=0; i<NODE_COUNT; i++) nodes[i].active = 0;
-
-    // Faza REJESTRACJI
-    while(reg_cnt < NODE_COUNT) {
-        int n = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr*)&caddr, &clen);
-        if (n > 0 && (buf[0] & 0x0F) == MSG_REGISTER) {
-            int nid = buf[2];
-            if(nid >= 1 && nid <= NODE_COUNT && nodes[nid-1].active == 0) {
-                nodes[nid-1].id = nid;
-                nodes[nid-1].addr = caddr;
-                nodes[nid-1].active = 1;
-                reg_cnt++;
-                printf("Node %d registered.\n", nid);
-                
-                uint8_t ack[6]; 
-                pack_header(ack, MSG_ACK, buf[1], 0, 0); 
-                ack[5]=calc_crc(ack,5);
-                sendto(sock, ack, 6, 0, (struct sockaddr*)&caddr, clen);
+    for(int i=0; i<NODE_COUNT; i++) { nodes[i].active = 0; nodes[i].assigned = 0; }
+
+    // Start jako graf zależności: rozwinięcie L-systemu potrzebuje tylko configu, więc idzie na wątku
+    // roboczym, a sieć w tym czasie rejestruje nody, wysyła ASSIGN każdemu zaraz po jego REGISTER
+    // i pyta noda startowego o współrzędne, gdy tylko jest skonfigurowany.
+    // Pierwszy chunk wychodzi po max(generacja, rejestracja), nie po sumie.
+    // Nie trzeba czekać na wszystkie nody: wystarczy kworum, gdy przez START_GRACE_USEC nikt nowy
+    // nie doszedł. Region brakującego noda rysuje serwer, dopóki ten się nie zgłosi (checkpoint()).
+    pthread_t gen_thread;
+    int gen_async = pthread_create(&gen_thread, NULL, generate_worker, NULL) == 0;
+    if(!gen_async) generate_lsystem();
+
+    int origin_idx = get_node_index((int)config.start_x, (int)config.start_y);
+    gettimeofday(&last_join, NULL);
+    while(1) {
+        // Nody zarejestrowane w międzyczasie (także w trakcie send_reliable) dostają ASSIGN od razu
+        int assigned = 0;
+        for(int i=0; i<NODE_COUNT; i++) {
+            if(nodes[i].active && !nodes[i].assigned) {
+                nodes[i].assigned = assign_node(sock, i, buf, sizeof(buf));
+                if(!nodes[i].assigned) nodes[i].active = 0;
+                else if(i == origin_idx) fetch_origin_coordinates(sock);
             }
+            assigned += nodes[i].assigned;
         }
-    }
+        if(assigned == NODE_COUNT) break;
+        if(assigned >= quorum && elapsed_usec(&last_join) >= START_GRACE_USEC) break;
 
-    printf("Assigning regions (RELIABLE)...\n");
-    
-    // Faza ASSIGN (Teraz w pętli reliability!)
+        struct timeval tv = { 0, 100000 };
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        clen = sizeof(caddr);
+        int n = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr*)&caddr, &clen);
+        if (n >= 5) note_alive(&caddr);
+        if (n > 0 && (buf[0] & 0x0F) == MSG_REGISTER) register_node(sock, buf, n, &caddr);
+    }
     for(int i=0; i<NODE_COUNT; i++) {
-        uint8_t msg[32]; 
-        global_seq++;
-        pack_header(msg, MSG_ASSIGN, global_seq, nodes[i].id, 8);
-        int idx = nodes[i].id - 1;
-        
-        // Obliczamy parametry dla noda
-        uint8_t rx = (idx % 2) * NODE_GRID_SIZE;
-        uint8_t ry = (idx / 2) * NODE_GRID_SIZE;
-        
-        msg[5] = rx; msg[6] = ry; 
-        msg[7] = NODE_GRID_SIZE; msg[8] = NODE_GRID_SIZE; 
-        
-        int16_t ang = (int16_t)config.angle_deg;
-        int16_t stp = (int16_t)(config.step * 100); 
-        
-        msg[9] = (ang >> 8) & 0xFF; msg[10] = ang & 0xFF;
-        msg[11] = (stp >> 8) & 0xFF; msg[12] = stp & 0xFF;
-        
-        msg[13] = calc_crc(msg, 13);
-        
-        // WYŚLIJ I CZEKAJ NA ACK
-        printf("Sending ASSIGN to Node %d...\n", nodes[i].id);
-        int res = send_reliable(sock, i, msg, 14, MSG_ACK, buf, sizeof(buf));
-        if(res < 0) {
-            printf("Failed to configure Node %d!\n", nodes[i].id);
-        } else {
-            printf("Node %d configured (ACK received).\n", nodes[i].id);
-        }
+        if(nodes[i].assigned) continue;
+        nodes[i].local = 1;
+        printf("No node for region %d yet: the server draws it.\n", i);
+        name_lane(i);
     }
 
-    fetch_origin_coordinates(sock);
+    span_complete("registration+assign", t0, 0, reg_cnt);
+
+    if(gen_async) {
+        uint64_t w0 = span_now();
+        pthread_join(gen_thread, NULL);
+        span_complete("wait_generate", w0, 0, -1);
+    }
 
-    generate_lsystem();
     run_simulation(sock);
     collect_results(sock);
 
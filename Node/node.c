@@ -9,63 +9,61 @@
 #include <sys/time.h>
 #include <stdint.h>
 
+#include "../Common/turtle.h"
+#include "../Common/cmdstream.h"
+#include "../Common/trace.h"
+#include "../Common/frag.h"
+#include "../Common/caps.h"
+
 /* ================= KONFIGURACJA ================= */
 #define ALP_VERSION      1
-#define MSG_REGISTER     0x1
+#define MSG_REGISTER     0x1     // od serwera bez payloadu: "zarejestruj się jeszcze raz"
 #define MSG_ASSIGN       0x2
 #define MSG_DATA         0x3
 #define MSG_ACK          0x4
 #define MSG_REQUEST      0x5
 #define MSG_RESPONSE     0x6
 #define MSG_HANDOVER     0x7
+#define MSG_PASS         0xA
+#define MSG_PROGRESS     0xB
+#define MSG_HEARTBEAT    0xC     // node -> serwer co HEARTBEAT_MS, bez odpowiedzi
+#define REGION_ALL       0xFF    // REQUEST: cały region zamiast jednego wiersza
+#define ASSIGN_KEEP      0x80    // ASSIGN: tylko nowa tablica sąsiadów (failover), siatka zostaje
 
 #define MAX_STR          8192  
+#define RX_BUF           (MAX_STR + 64)
 #define MAX_REGION       32
 #define SERVER_IP        "192.168.56.104" 
 #define SERVER_PORT      8000
 #define NODE_ID          4 
 #define TIMEOUT_MS       200
 #define MAX_RETRIES      3
+#define MAX_PEERS        16
+#define BENCH_RUNS       5       // przebiegi pomiaru szybkości (mediana)
+#define HEARTBEAT_MS     500     // serwer uznaje noda za martwego po kilku brakujących
+
+typedef struct {
+    uint8_t id;
+    int rx, ry, rw, rh;
+    struct sockaddr_in addr;
+} Peer;
 
-char grid[MAX_REGION][MAX_REGION];
+char grid[MAX_REGION * MAX_REGION];   // region rw x rh, dowolny kształt
 int rx, ry, rw, rh, g_angle;
 int sockfd;
+int my_id = NODE_ID;
 struct sockaddr_in servaddr;
-
-/* ================= OPTYMALIZACJA IOT (LUT) ================= */
-double SIN_LUT[91]; 
-
-void init_lut() {
-    double PI = 3.1415926535;
-    for(int i=0; i<=90; i++) {
-        double x = i * (PI / 180.0);
-        double res = x - (x*x*x)/6.0 + (x*x*x*x*x)/120.0 - (x*x*x*x*x*x*x)/5040.0;
-        SIN_LUT[i] = res;
-    }
-    SIN_LUT[0] = 0.0; SIN_LUT[30] = 0.5; SIN_LUT[90] = 1.0;
-}
-
-double fast_sin(int deg) {
-    deg %= 360;
-    if (deg < 0) deg += 360;
-    if (deg <= 90) return SIN_LUT[deg];
-    if (deg <= 180) return SIN_LUT[180 - deg];
-    if (deg <= 270) return -SIN_LUT[deg - 180];
-    return -SIN_LUT[360 - deg];
-}
-
-double fast_cos(int deg) {
-    return fast_sin(deg + 90);
-}
-
-// Rzutowanie na int (zgodność z serwerem)
-int fast_floor(double x) {
-    return (int)x; 
-}
-
-int fast_round(double x) {
-    return (int)(x + 0.5);
-}
+Peer peers[MAX_PEERS];
+int peer_count = 0;
+int server_mtu;              // największy datagram do serwera bez fragmentacji IP
+Reasm reasm;
+
+// Ostatni chunk: typ + nagłówek (tag, base, stan, liczba komend) i jego wynik. Powtórzony DATA/PASS
+// (zgubiona odpowiedź, ponowienie serwera) dostaje tę samą odpowiedź, ale nie jest rysowany drugi raz.
+uint8_t last_key[20];
+int last_key_len = 0;
+int last_done, last_exited;
+Turtle last_t;
 
 /* ================= ALP PROTOCOL & RELIABILITY ================= */
 uint8_t alp_crc(uint8_t *buf, int len) {
@@ -85,10 +83,11 @@ void send_ack(int sock, struct sockaddr_in *dest) {
     uint8_t buf[5];
     pack_header(buf, MSG_ACK, 0, 0);
     buf[4] = alp_crc(buf, 4);
-    sendto(sock, buf, 5, 0, (struct sockaddr *)dest, sizeof(*dest));
+    trace_sendto(sock, buf, 5, 0, (struct sockaddr *)dest, sizeof(*dest));
 }
 
-void send_reliable(uint8_t *buf, int len) {
+// Zwraca 1 po ACK, 0 gdy serwer nie odpowiedział
+int send_reliable(uint8_t *buf, int len) {
     struct timeval tv;
     tv.tv_sec = 0;
     tv.tv_usec = TIMEOUT_MS * 1000;
@@ -99,161 +98,331 @@ void send_reliable(uint8_t *buf, int len) {
     uint8_t ack_buf[16];
 
     for(int i=0; i<MAX_RETRIES; i++) { 
-        sendto(sockfd, buf, len, 0, (struct sockaddr *)&servaddr, sizeof(servaddr));
+        trace_sendto(sockfd, buf, len, 0, (struct sockaddr *)&servaddr, sizeof(servaddr));
         
-        int n = recvfrom(sockfd, ack_buf, sizeof(ack_buf), 0, (struct sockaddr *)&from, &from_len);
+        int n = trace_recvfrom(sockfd, ack_buf, sizeof(ack_buf), 0, (struct sockaddr *)&from, &from_len);
         if (n > 0) {
             int type = ack_buf[0] & 0x0F;
-            if (type == MSG_ACK) return; 
+            if (type == MSG_ACK) return 1; 
         }
         // printf("Wait for ACK... Retry %d\n", i+1);
     }
     printf("ERROR: Server unreachable.\n");
+    return 0;
 }
 
-void send_handover(int idx, double x, double y, double angle) {
-    uint8_t buf[64];
-    pack_header(buf, MSG_HANDOVER, NODE_ID, 26);
-    int pos = 4;
-
-    buf[pos++] = (idx >> 8) & 0xFF;
-    buf[pos++] = idx & 0xFF;
-    memcpy(&buf[pos], &x, 8); pos += 8;
-    memcpy(&buf[pos], &y, 8); pos += 8;
-    memcpy(&buf[pos], &angle, 8); pos += 8;
+// Chunk narysowany do końca: ACK z tagiem chunka, żeby serwer nie zaliczył go innemu
+void send_chunk_ack(int tag) {
+    uint8_t buf[8];
+    pack_header(buf, MSG_ACK, my_id, 2);
+    buf[4] = (tag >> 8) & 0xFF; buf[5] = tag & 0xFF;
+    buf[6] = alp_crc(buf, 6);
+    trace_sendto(sockfd, buf, 7, 0, (struct sockaddr *)&servaddr, sizeof(servaddr));
+}
 
-    buf[pos++] = alp_crc(buf, pos);
-    
-    send_reliable(buf, pos);
-    printf(">>> Handover sent! (Idx %d)\n", idx);
+void send_heartbeat() {
+    uint8_t buf[5];
+    pack_header(buf, MSG_HEARTBEAT, my_id, 0);
+    buf[4] = alp_crc(buf, 4);
+    trace_sendto(sockfd, buf, 5, 0, (struct sockaddr *)&servaddr, sizeof(servaddr));
 }
 
-/* ================= LOGIKA RYSOWANIA ================= */
-void draw_turtle_smart(const char *word, int start_idx, double start_x, double start_y, double start_angle) {
-    double cur_x = start_x;
-    double cur_y = start_y;
-    
-    int current_angle_deg = (int)fast_round(start_angle * 180.0 / 3.1415926535);
+void send_handover(int tag, int proc, Turtle *t) {
+    uint8_t buf[32];
+    pack_header(buf, MSG_HANDOVER, my_id, 16);
+    buf[4] = (tag >> 8) & 0xFF; buf[5] = tag & 0xFF;
+    turtle_put(&buf[6], t);
+    buf[18] = (proc >> 8) & 0xFF;
+    buf[19] = proc & 0xFF;
+    buf[20] = alp_crc(buf, 20);
+
+    trace_sendto(sockfd, buf, 21, 0, (struct sockaddr *)&servaddr, sizeof(servaddr));
+    printf(">>> Handover sent! (Processed %d)\n", proc);
+}
 
-    if(cur_x < rx) cur_x = rx + 0.001;
-    if(cur_x >= rx+rw) cur_x = rx + rw - 0.001;
-    if(cur_y < ry) cur_y = ry + 0.001;
-    if(cur_y >= ry+rh) cur_y = ry + rh - 0.001;
+// Żółw przechodzi bezpośrednio do sąsiada: stan + cały skompresowany chunk,
+// sąsiad pomija pierwsze base komend (nie da się uciąć strumienia w środku referencji)
+void send_pass(Peer *p, int tag, int base, Turtle *t, const uint8_t *enc, int enc_len, int count) {
+    uint8_t buf[MAX_STR + 32];
+    pack_header(buf, MSG_PASS, my_id, 18 + enc_len);
+    buf[4] = (tag >> 8) & 0xFF; buf[5] = tag & 0xFF;
+    buf[6] = (base >> 8) & 0xFF; buf[7] = base & 0xFF;
+    turtle_put(&buf[8], t);
+    buf[20] = (count >> 8) & 0xFF; buf[21] = count & 0xFF;
+    memcpy(&buf[22], enc, enc_len);
+    buf[22 + enc_len] = alp_crc(buf, 22 + enc_len);
+    trace_sendto(sockfd, buf, 23 + enc_len, 0, (struct sockaddr *)&p->addr, sizeof(p->addr));
+
+    // Serwer dostaje tylko asynchroniczną informację o postępie
+    uint8_t pr[16];
+    pack_header(pr, MSG_PROGRESS, my_id, 5);
+    pr[4] = (tag >> 8) & 0xFF; pr[5] = tag & 0xFF;
+    pr[6] = p->id;
+    pr[7] = (base >> 8) & 0xFF; pr[8] = base & 0xFF;
+    pr[9] = alp_crc(pr, 9);
+    trace_sendto(sockfd, pr, 10, 0, (struct sockaddr *)&servaddr, sizeof(servaddr));
+    printf(">>> Passed to Node %d (Processed %d)\n", p->id, base);
+}
 
-    int start_ix = fast_floor(cur_x);
-    int start_iy = fast_floor(cur_y);
-    
-    if (start_ix >= rx && start_ix < rx + rw && start_iy >= ry && start_iy < ry + rh) {
-        grid[start_iy - ry][start_ix - rx] = '#';
+Peer *find_peer(int x, int y) {
+    for (int i = 0; i < peer_count; i++) {
+        Peer *p = &peers[i];
+        if (p->id == my_id) continue;
+        if (x >= p->rx && x < p->rx + p->rw && y >= p->ry && y < p->ry + p->rh) return p;
     }
+    return NULL;
+}
 
-    for (int i = start_idx; word[i]; i++) {
-        if (word[i] == 'F') {
-            double next_x = cur_x + fast_cos(current_angle_deg);
-            double next_y = cur_y - fast_sin(current_angle_deg); 
+/* ================= LOGIKA RYSOWANIA ================= */
+// Geometria (stałoprzecinkowa, DDA + Liang-Barsky) wspólna z serwerem: Common/turtle.h
+void plot_cell(int cx, int cy, void *ctx) {
+    (void)ctx;      // node ma jedną siatkę - globalną
+    if (cx >= rx && cx < rx + rw && cy >= ry && cy < ry + rh) grid[(cy - ry) * rw + cx - rx] = '#';
+}
 
-            int ix = fast_floor(next_x);
-            int iy = fast_floor(next_y);
+// Komendy dekodowane prosto z pakietu (Common/cmdstream.h). Chunki nie zawierają nawiasów.
+// Zwraca liczbę wykonanych komend; *exited = 1 gdy ruch wyszedł poza region
+// (żółw stoi wtedy na granicy, t->rem = reszta odcinka dla sąsiada)
+int draw_turtle_smart(CmdReader *r, int len, Turtle *t, int *exited) {
+    *exited = 0;
 
-            if (ix < rx || ix >= rx + rw || iy < ry || iy >= ry + rh) {
-                double angle_rad = current_angle_deg * 3.1415926535 / 180.0;
-                send_handover(i + 1, next_x, next_y, angle_rad);
-                return; 
+    if (t->rem && turtle_forward(t, FX_ONE, rx, ry, rx + rw, ry + rh, plot_cell, NULL)) {
+        *exited = 1;
+        return 0;
+    }
+    for (int i = 0; i < len; i++) {
+        char c = cmd_next(r);
+        if (c == 'F') {
+            if (turtle_forward(t, FX_ONE, rx, ry, rx + rw, ry + rh, plot_cell, NULL)) {
+                *exited = 1;
+                return i + 1;
             }
-            grid[iy - ry][ix - rx] = '#';
-            cur_x = next_x; cur_y = next_y;
-        } else if (word[i] == '+') {
-            current_angle_deg += g_angle;
-        } else if (word[i] == '-') {
-            current_angle_deg -= g_angle;
+        } else if (c == '+') {
+            turtle_turn(t, g_angle);
+        } else if (c == '-') {
+            turtle_turn(t, -g_angle);
+        } else if (c == 0) {
+            return i;
         }
     }
-    double angle_rad = current_angle_deg * 3.1415926535 / 180.0;
-    send_handover(strlen(word), cur_x, cur_y, angle_rad);
+    return len;
+}
+
+// Odpowiedź na chunk: PASS do sąsiada, HANDOVER albo ACK
+void reply_chunk(int tag, int base, int done, int exited, Turtle *t, const uint8_t *enc, int enc_len, int count, int direct) {
+    if (exited) {
+        int cx, cy;
+        turtle_cell(t, FX_ONE, &cx, &cy);
+        Peer *p = find_peer(cx, cy);
+        if (p) send_pass(p, tag, base + done, t, enc, enc_len, count);
+        else send_handover(tag, base + done, t);
+    }
+    else if (direct) send_chunk_ack(tag);
+    else send_handover(tag, base + done, t);
+}
+
+// base = komendy chunka wykonane już przez poprzednie nody, direct = chunk przyszedł od serwera
+void run_chunk(int tag, int base, const uint8_t *enc, int enc_len, int count, Turtle t, int direct) {
+    int exited;
+    CmdReader r;
+    cmd_reader(&r, enc, enc_len);
+    for (int i = 0; i < base; i++) cmd_next(&r);
+    int done = draw_turtle_smart(&r, count - base, &t, &exited);
+    last_done = done; last_exited = exited; last_t = t;
+    reply_chunk(tag, base, done, exited, &t, enc, enc_len, count, direct);
+}
+
+// Jeden przebieg pomiaru: draw_turtle_smart na syntetycznym chunku (kwadraty 8x8 w regionie
+// MAX_REGION x MAX_REGION) przez ~limit_us mikrosekund. Zwraca tysiące komend na sekundę.
+long bench_kcps(const uint8_t *enc, int enc_len, int count, long limit_us) {
+    Turtle t = { FX(MAX_REGION / 2 + 0.5), FX(MAX_REGION / 2 + 0.5), 0, 0 };
+    struct timeval t0, now;
+    long cmds = 0, us;
+    gettimeofday(&t0, NULL);
+    do {
+        int exited;
+        CmdReader r;
+        cmd_reader(&r, enc, enc_len);
+        cmds += draw_turtle_smart(&r, count, &t, &exited);
+        gettimeofday(&now, NULL);
+        us = (now.tv_sec - t0.tv_sec) * 1000000L + (now.tv_usec - t0.tv_usec);
+    } while (us < limit_us);
+    return cmds / (us / 1000 + 1);
+}
+
+// Pomiar szybkości do REGISTER: rozgrzewka, potem mediana z BENCH_RUNS przebiegów po ~100 ms,
+// zaokrąglona do najbliższej potęgi dwójki - jednakowe nody na jednym hoście podają to samo,
+// a serwer i tak potrzebuje tylko proporcji. ALP_KCPS=n podaje wynik z góry (np. żeby na jednym
+// hoście udawać wolniejsze nody).
+int measure_kcps() {
+    const char *env = getenv("ALP_KCPS");
+    if (env) return atoi(env);
+
+    char s[252];
+    for (int i = 0; i < (int)sizeof(s); i++) s[i] = i % 9 == 8 ? '+' : 'F';
+    uint8_t enc[CMD_MAX_TOK];
+    int count, enc_len = cmd_encode(s, sizeof(s), enc, sizeof(enc), &count, 1);
+
+    rx = ry = 0; rw = rh = MAX_REGION; g_angle = 90;
+    long runs[BENCH_RUNS];
+    bench_kcps(enc, enc_len, count, 20000);
+    for (int i = 0; i < BENCH_RUNS; i++) {
+        long k = bench_kcps(enc, enc_len, count, 100000), j = i;
+        for (; j > 0 && runs[j - 1] > k; j--) runs[j] = runs[j - 1];
+        runs[j] = k;
+    }
+    rw = rh = 0;
+    memset(grid, '.', sizeof(grid));
+
+    long med = runs[BENCH_RUNS / 2], pow2 = 1;
+    while (pow2 * 2 <= med) pow2 *= 2;
+    return med - pow2 < pow2 * 2 - med ? pow2 : pow2 * 2;
 }
 
 int main(int argc, char *argv[]) {
     setvbuf(stdout, NULL, _IONBF, 0); 
     memset(grid, '.', sizeof(grid));
-    init_lut();
+    turtle_init();
     
-    int my_id = NODE_ID;
+    const char *server_ip = SERVER_IP;
+    int server_port = SERVER_PORT;
     if(argc > 1) my_id = atoi(argv[1]);
-    printf("Node %d starting... (LUT Enabled)\n", my_id);
+    if(argc > 2) server_ip = argv[2];
+    if(argc > 3) server_port = atoi(argv[3]);   // serwer z ALP_PORT (np. kilka serwerów na jednym hoście)
+    printf("Node %d starting...\n", my_id);
 
     sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    char name[16];
+    snprintf(name, sizeof(name), "node%d", my_id);
+    trace_open(name);   // ALP_TRACE=<plik> zapisuje każdy datagram (Common/trace.h)
     
     struct timeval tv = {0, 0};
     setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
 
     memset(&servaddr, 0, sizeof(servaddr));
     servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons(SERVER_PORT);
-    inet_pton(AF_INET, SERVER_IP, &servaddr.sin_addr);
+    servaddr.sin_port = htons(server_port);
+    inet_pton(AF_INET, server_ip, &servaddr.sin_addr);
 
-    // Rejestracja
+    server_mtu = path_mtu(&servaddr);
+    frag_reset(&reasm);
+
+    // Rejestracja, payload: możliwości noda (Common/caps.h) - serwer dobiera do nich region i chunki
+    Caps caps = { RX_BUF, MAX_REGION * MAX_REGION, CAPS_ENC_ALL, measure_kcps() };
     uint8_t buf[16];
-    pack_header(buf, MSG_REGISTER, my_id, 0);
-    buf[4] = alp_crc(buf, 4);
+    pack_header(buf, MSG_REGISTER, my_id, CAPS_LEN);
+    caps_put(&buf[4], &caps);
+    buf[4 + CAPS_LEN] = alp_crc(buf, 4 + CAPS_LEN);
     
-    printf("Sending REGISTER...\n");
-    send_reliable(buf, 5);
+    // Serwer może wystartować później albo liczyć już zadanie - node dołącza, kiedy tylko odpowie
+    printf("Sending REGISTER (%d kcmd/s)...\n", caps.kcps);
+    while (!send_reliable(buf, 5 + CAPS_LEN)) sleep(1);
     printf("REGISTERED!\n");
 
-    uint8_t buffer[MAX_STR + 64];
+    uint8_t buffer[RX_BUF];
+    struct timeval hb_last = {0, 0};
     while (1) {
-        struct timeval tv_zero = {0, 0};
-        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv_zero, sizeof tv_zero);
+        // Heartbeat także w trakcie pracy - serwer liczy ciszę od ostatniego datagramu
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        if ((now.tv_sec - hb_last.tv_sec) * 1000L + (now.tv_usec - hb_last.tv_usec) / 1000 >= HEARTBEAT_MS) {
+            send_heartbeat();
+            hb_last = now;
+        }
+        struct timeval tv_hb = {0, HEARTBEAT_MS * 1000};
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv_hb, sizeof tv_hb);
 
-        int n = recvfrom(sockfd, buffer, sizeof(buffer), 0, NULL, NULL);
+        int n = trace_recvfrom(sockfd, buffer, sizeof(buffer), 0, NULL, NULL);
         if (n <= 0) continue;
 
         int type = (buffer[0]) & 0x0F;
+        if (type == MSG_FRAG) {
+            // Fragment większej wiadomości - po złożeniu obsługujemy ją jak zwykły pakiet
+            if (!(n = frag_add(&reasm, NULL, buffer, n))) continue;
+            memcpy(buffer, reasm.buf, n);
+            type = buffer[0] & 0x0F;
+        }
 
-        if (type == MSG_ASSIGN) {
+        if (type == MSG_REGISTER) {
+            // Serwer nas nie zna (uznał za martwego albo wystartował od nowa) - ACK przyjdzie jak zwykle
+            printf("Server asks to register again\n");
+            trace_sendto(sockfd, buf, 5 + CAPS_LEN, 0, (struct sockaddr *)&servaddr, sizeof(servaddr));
+        }
+        else if (type == MSG_ASSIGN) {
             send_ack(sockfd, &servaddr); 
             rx = buffer[4]; ry = buffer[5];
             rw = buffer[6]; rh = buffer[7];
             g_angle = buffer[8];
-            printf("ASSIGN: Region (%d,%d)\n", rx, ry);
+            int keep = buffer[9] & ASSIGN_KEEP;
+            if (rw * rh > (int)sizeof(grid)) {
+                printf("WARN: Region %dx%d too big, clipping\n", rw, rh);
+                rh = sizeof(grid) / (rw ? rw : 1);
+            }
+            if (!keep) { memset(grid, '.', sizeof(grid)); last_key_len = 0; }
+
+            // Tablica sąsiadów: [id rx ry rw rh ip(4) port(2)]
+            peer_count = 0;
+            int pos = 10;
+            for (int i = 0; i < (buffer[9] & ~ASSIGN_KEEP) && peer_count < MAX_PEERS && pos + 11 <= n; i++) {
+                Peer *p = &peers[peer_count++];
+                p->id = buffer[pos++];
+                p->rx = buffer[pos++]; p->ry = buffer[pos++];
+                p->rw = buffer[pos++]; p->rh = buffer[pos++];
+                memset(&p->addr, 0, sizeof(p->addr));
+                p->addr.sin_family = AF_INET;
+                memcpy(&p->addr.sin_addr.s_addr, &buffer[pos], 4); pos += 4;
+                memcpy(&p->addr.sin_port, &buffer[pos], 2); pos += 2;
+            }
+            printf("ASSIGN: Region (%d,%d), %d peers\n", rx, ry, peer_count);
         }
-        else if (type == MSG_DATA) {
-            send_ack(sockfd, &servaddr); 
-            
-            int idx = (buffer[4] << 8) | buffer[5];
-            double sx, sy, sa;
-            memcpy(&sx, &buffer[6], 8);
-            memcpy(&sy, &buffer[14], 8);
-            memcpy(&sa, &buffer[22], 8);
-            
-            char word[MAX_STR];
-            int word_len = (buffer[2] << 8) | buffer[3];
-            word_len -= 26; 
-
-            memcpy(word, &buffer[30], word_len);
-            word[word_len] = '\0';
-
-            printf("TASK: Idx %d. Working...\n", idx);
-            draw_turtle_smart(word, idx, sx, sy, sa);
+        else if (type == MSG_DATA || type == MSG_PASS) {
+            // DATA: tag(2) stan(12) liczba_komend(2) strumień; PASS dodatkowo base(2) po tagu
+            int hdr = type == MSG_DATA ? 20 : 22;
+            int enc_len = ((buffer[2] << 8) | buffer[3]) - (hdr - 4);
+            if (enc_len < 0 || hdr + enc_len > n) continue;
+
+            int tag = (buffer[4] << 8) | buffer[5];
+            int base = 0;
+            Turtle t;
+            if (type == MSG_PASS) base = (buffer[6] << 8) | buffer[7];
+            turtle_get(&buffer[hdr - 14], &t);
+            int count = (buffer[hdr - 2] << 8) | buffer[hdr - 1];
+            if (base > count) continue;
+
+            // Ten sam tag wraca legalnie tylko z innym base/stanem (żółw obszedł sąsiadów i wrócił)
+            if (last_key_len == hdr - 3 && last_key[0] == type && memcmp(&last_key[1], &buffer[4], hdr - 4) == 0) {
+                printf("TASK %d repeated, answering again\n", tag);
+                reply_chunk(tag, base, last_done, last_exited, &last_t, &buffer[hdr], enc_len, count, type == MSG_DATA);
+                continue;
+            }
+            last_key[0] = type;
+            memcpy(&last_key[1], &buffer[4], hdr - 4);
+            last_key_len = hdr - 3;
+
+            printf("TASK: %d cmds (%d bytes) at %.2f,%.2f. Working...\n", count - base, enc_len, t.x / 65536.0, t.y / 65536.0);
+            run_chunk(tag, base, &buffer[hdr], enc_len, count, t, type == MSG_DATA);
         }
         else if (type == MSG_REQUEST) {
-            // === POPRAWKA TUTAJ: Najpierw potwierdź (ACK), potem wyślij dane ===
-            send_ack(sockfd, &servaddr);
-            
-            uint8_t resp[2048];
-            int data_size = rw * rh;
-            pack_header(resp, MSG_RESPONSE, my_id, data_size);
-            int pos = 4;
-            
-            for(int y = 0; y < rh; y++) 
-                for(int x = 0; x < rw; x++) 
-                    resp[pos++] = grid[y][x];
-            
-            resp[pos++] = alp_crc(resp, pos); 
-            
-            printf("Request received. Sending %d bytes...\n", data_size);
-            send_reliable(resp, pos);
-            printf("Data sent & ACKed.\n");
+            int row = buffer[4];
+            if (row == REGION_ALL) {
+                // Cały region naraz: REGION_ALL rw rh + wiersze, pofragmentowany do MTU ścieżki
+                static uint8_t all[MAX_REGION * MAX_REGION + 16];
+                pack_header(all, MSG_RESPONSE, my_id, 3 + rw * rh);
+                all[4] = REGION_ALL; all[5] = rw; all[6] = rh;
+                memcpy(&all[7], grid, rw * rh);
+                all[7 + rw * rh] = alp_crc(all, 7 + rw * rh);
+                frag_send(sockfd, &servaddr, all, 8 + rw * rh, server_mtu);
+                continue;
+            }
+            // Pojedynczy wiersz
+            if (row >= rh) continue;
+
+            uint8_t resp[MAX_REGION * MAX_REGION + 8];
+            pack_header(resp, MSG_RESPONSE, my_id, 1 + rw);
+            resp[4] = row;
+            memcpy(&resp[5], &grid[row * rw], rw);
+            resp[5 + rw] = alp_crc(resp, 5 + rw);
+            trace_sendto(sockfd, resp, 6 + rw, 0, (struct sockaddr *)&servaddr, sizeof(servaddr));
         }
     }
     close(sockfd);
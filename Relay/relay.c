@@ -0,0 +1,336 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdint.h>
+
+// Linux counterpart of Node-IOT+Lab/E.ino for many sensor systems at once.
+// Same wire format: 31-byte packets, type at [0], value at [7..8], SYSTEM_ID at [15..30].
+//  U -> relay  MSG_FROM_U  angle measured by U
+//  relay -> W  MSG_TO_W    diff = reference angle - U angle (only when positive, as in E.ino)
+//  W -> relay  MSG_ACK     echoes SYSTEM_ID
+// Flows (one per SYSTEM_ID) live in an open-addressing hash table. Each flow has its own W
+// address and reference angle, and at most one MSG_TO_W waiting for an ACK: a newer reading
+// replaces it, an unanswered one is resent after -t ms up to -r times. Datagrams are received
+// and sent in batches with recvmmsg/sendmmsg.
+
+#define PORT_E      12316
+#define PORT_W      8822
+#define MSG_FROM_U  0x01
+#define MSG_TO_W    0x02
+#define MSG_ACK     0x03
+#define PKT_LEN     31
+#define ID_OFF      15
+#define ID_LEN      16
+
+#define MAX_FLOWS   (1 << 16)       // hash slots (power of two); at most 3/4 are used
+#define BATCH       64
+
+typedef struct {
+    uint8_t id[ID_LEN];
+    uint8_t used;
+    uint8_t tries;                  // 0 = no MSG_TO_W waiting for an ACK
+    uint16_t angle;                 // reference angle (E's own sensor in E.ino)
+    uint16_t diff;                  // last value sent to W, kept for resending
+    struct sockaddr_in w;
+    uint64_t sent_ns;
+    int prev, next;                 // list of flows waiting for an ACK, oldest first
+    uint32_t from_u, to_w, acked, resent, lost, replaced;
+    uint64_t rtt_ns;
+} Flow;
+
+Flow flows[MAX_FLOWS];
+int flow_count = 0;
+int wait_head = -1, wait_tail = -1;
+
+struct sockaddr_in default_w;
+int have_default_w = 0;
+uint16_t default_angle = 512;
+uint64_t ack_timeout_ns = 200000000ull;
+int max_tries = 3;
+
+long rx_pkts = 0, rx_batches = 0, tx_pkts = 0, tx_batches = 0;
+long n_from_u = 0, n_to_w = 0, n_acks = 0, n_dup_acks = 0, n_resent = 0, n_lost = 0;
+long n_unknown = 0, n_bad = 0, n_below = 0;
+volatile sig_atomic_t running = 1;
+
+// Outgoing batch
+uint8_t out_buf[BATCH][PKT_LEN];
+struct sockaddr_in out_addr[BATCH];
+int out_n = 0;
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// --- FLOW TABLE ---
+uint32_t flow_hash(const uint8_t *id) {
+    uint64_t a, b;
+    memcpy(&a, id, 8); memcpy(&b, id + 8, 8);
+    uint64_t h = (a ^ (b * 0x9E3779B97F4A7C15ull)) * 0xBF58476D1CE4E5B9ull;
+    return (uint32_t)(h ^ (h >> 31));
+}
+
+// Slot of the flow, or of the empty slot where it would go
+int flow_slot(const uint8_t *id) {
+    int i = flow_hash(id) & (MAX_FLOWS - 1);
+    while(flows[i].used && memcmp(flows[i].id, id, ID_LEN) != 0) i = (i + 1) & (MAX_FLOWS - 1);
+    return i;
+}
+
+Flow *flow_add(const uint8_t *id, const struct sockaddr_in *w, uint16_t angle) {
+    int i = flow_slot(id);
+    Flow *f = &flows[i];
+    if(f->used) { f->w = *w; f->angle = angle; return f; }
+    if(flow_count >= MAX_FLOWS / 4 * 3) return NULL;
+    memset(f, 0, sizeof(*f));
+    memcpy(f->id, id, ID_LEN);
+    f->used = 1; f->w = *w; f->angle = angle;
+    f->prev = f->next = -1;
+    flow_count++;
+    return f;
+}
+
+Flow *flow_find(const uint8_t *id) {
+    Flow *f = &flows[flow_slot(id)];
+    return f->used ? f : NULL;
+}
+
+// --- ACK WAIT LIST ---
+// Every entry has the same timeout, so appending keeps the list ordered by deadline.
+void wait_remove(Flow *f) {
+    int i = f - flows;
+    if(f->prev >= 0) flows[f->prev].next = f->next; else if(wait_head == i) wait_head = f->next;
+    if(f->next >= 0) flows[f->next].prev = f->prev; else if(wait_tail == i) wait_tail = f->prev;
+    f->prev = f->next = -1;
+}
+
+void wait_append(Flow *f) {
+    int i = f - flows;
+    f->prev = wait_tail; f->next = -1;
+    if(wait_tail >= 0) flows[wait_tail].next = i; else wait_head = i;
+    wait_tail = i;
+}
+
+// --- NETWORK ---
+void flush_out(int sock) {
+    struct mmsghdr msgs[BATCH];
+    struct iovec iov[BATCH];
+    int sent = 0;
+    memset(msgs, 0, sizeof(msgs[0]) * out_n);
+    for(int i = 0; i < out_n; i++) {
+        iov[i].iov_base = out_buf[i]; iov[i].iov_len = PKT_LEN;
+        msgs[i].msg_hdr.msg_iov = &iov[i]; msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &out_addr[i]; msgs[i].msg_hdr.msg_namelen = sizeof(out_addr[i]);
+    }
+    while(sent < out_n) {
+        int n = sendmmsg(sock, msgs + sent, out_n - sent, 0);
+        if(n <= 0) break;
+        sent += n;
+        tx_batches++;
+    }
+    tx_pkts += sent;
+    out_n = 0;
+}
+
+void send_to_w(int sock, Flow *f, uint64_t now) {
+    if(out_n == BATCH) flush_out(sock);
+    uint8_t *p = out_buf[out_n];
+    memset(p, 0, PKT_LEN);
+    p[0] = MSG_TO_W;
+    p[7] = (f->diff >> 8) & 0xFF;
+    p[8] = f->diff & 0xFF;
+    memcpy(&p[ID_OFF], f->id, ID_LEN);
+    out_addr[out_n++] = f->w;
+    f->sent_ns = now;
+    wait_append(f);
+}
+
+void handle(int sock, const uint8_t *p, int len, uint64_t now) {
+    if(len < PKT_LEN) { n_bad++; return; }
+    const uint8_t *id = &p[ID_OFF];
+
+    if(p[0] == MSG_FROM_U) {
+        Flow *f = flow_find(id);
+        if(!f && have_default_w) f = flow_add(id, &default_w, default_angle);
+        if(!f) { n_unknown++; return; }
+        n_from_u++; f->from_u++;
+        uint16_t angle_u = (p[7] << 8) | p[8];
+        if(f->angle <= angle_u) { n_below++; return; }
+
+        // Only the newest reading matters; it replaces one still waiting for an ACK
+        if(f->tries) { wait_remove(f); f->replaced++; }
+        f->diff = f->angle - angle_u;
+        f->tries = 1;
+        f->to_w++; n_to_w++;
+        send_to_w(sock, f, now);
+    }
+    else if(p[0] == MSG_ACK) {
+        Flow *f = flow_find(id);
+        if(!f) { n_unknown++; return; }
+        if(!f->tries) { n_dup_acks++; return; }
+        wait_remove(f);
+        f->tries = 0;
+        f->acked++; n_acks++;
+        f->rtt_ns += now - f->sent_ns;
+    }
+    else n_bad++;
+}
+
+void expire(int sock, uint64_t now) {
+    while(wait_head >= 0 && flows[wait_head].sent_ns + ack_timeout_ns <= now) {
+        Flow *f = &flows[wait_head];
+        wait_remove(f);
+        if(f->tries < max_tries) {
+            f->tries++;
+            f->resent++; n_resent++;
+            send_to_w(sock, f, now);
+        } else {
+            f->tries = 0;
+            f->lost++; n_lost++;
+        }
+    }
+}
+
+// --- CONFIG ---
+int parse_addr(const char *s, struct sockaddr_in *a, int def_port) {
+    char ip[64]; int port = def_port;
+    if(sscanf(s, "%63[^:]:%d", ip, &port) < 1) return -1;
+    memset(a, 0, sizeof(*a));
+    a->sin_family = AF_INET; a->sin_port = htons(port);
+    return inet_pton(AF_INET, ip, &a->sin_addr) == 1 ? 0 : -1;
+}
+
+// Lines: <SYSTEM_ID as 32 hex digits> <W ip[:port]> [reference angle]
+int load_flows(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if(!fp) { perror(path); return -1; }
+    char line[256];
+    int n = 0;
+    while(fgets(line, sizeof(line), fp)) {
+        char hex[64], w[64]; int angle = default_angle;
+        if(line[0] == '#' || sscanf(line, "%63s %63s %d", hex, w, &angle) < 2) continue;
+        uint8_t id[ID_LEN];
+        struct sockaddr_in wa;
+        int ok = strlen(hex) == 2 * ID_LEN && parse_addr(w, &wa, PORT_W) == 0;
+        for(int i = 0; ok && i < ID_LEN; i++) ok = sscanf(hex + 2 * i, "%2hhx", &id[i]) == 1;
+        if(!ok) { printf("WARN: bad flow line: %s", line); continue; }
+        if(!flow_add(id, &wa, angle)) { printf("WARN: flow table full\n"); break; }
+        n++;
+    }
+    fclose(fp);
+    printf("Loaded %d flows from %s\n", n, path);
+    return 0;
+}
+
+void print_stats(double secs) {
+    printf("[%.1fs] flows %d | rx %ld (%.1f/batch) tx %ld (%.1f/batch) | from U %ld, to W %ld, acked %ld, "
+           "resent %ld, lost %ld | unknown %ld, below ref %ld, bad %ld, dup ack %ld\n",
+           secs, flow_count, rx_pkts, rx_batches ? (double)rx_pkts / rx_batches : 0.0,
+           tx_pkts, tx_batches ? (double)tx_pkts / tx_batches : 0.0,
+           n_from_u, n_to_w, n_acks, n_resent, n_lost, n_unknown, n_below, n_bad, n_dup_acks);
+}
+
+void on_signal(int sig) { (void)sig; running = 0; }
+
+// --- MAIN ---
+int main(int argc, char *argv[]) {
+    setvbuf(stdout, NULL, _IONBF, 0);
+    int port = PORT_E, stats_s = 5, verbose = 0;
+    const char *flow_file = NULL;
+    int opt;
+    while((opt = getopt(argc, argv, "p:w:a:f:t:r:s:v")) != -1) {
+        if(opt == 'p') port = atoi(optarg);
+        else if(opt == 'w') {
+            if(parse_addr(optarg, &default_w, PORT_W) < 0) { printf("Bad W address %s\n", optarg); return 1; }
+            have_default_w = 1;
+        }
+        else if(opt == 'a') default_angle = atoi(optarg);
+        else if(opt == 'f') flow_file = optarg;
+        else if(opt == 't') ack_timeout_ns = (uint64_t)atoi(optarg) * 1000000ull;
+        else if(opt == 'r') max_tries = 1 + atoi(optarg);
+        else if(opt == 's') stats_s = atoi(optarg);
+        else if(opt == 'v') verbose = 1;
+        else {
+            printf("Usage: %s [-p port] [-w ip[:port]] [-a angle] [-f flows] [-t ack_ms] [-r resends] [-s stats_s] [-v]\n"
+                   "  -w  W for systems not in the flow file (learned on their first packet); without it they are dropped\n"
+                   "  -a  reference angle for learned systems (default %d)\n"
+                   "  -f  flow file: <SYSTEM_ID as 32 hex digits> <W ip[:port]> [angle] per line\n"
+                   "  -t  ms to wait for W's ACK (default 200), -r resends before giving up (default 2)\n"
+                   "  -v  per-flow table at exit\n", argv[0], default_angle);
+            return 1;
+        }
+    }
+    if(flow_file && load_flows(flow_file) < 0) return 1;
+    if(!flow_count && !have_default_w) printf("WARN: no flows and no -w: every system will be dropped\n");
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in self;
+    memset(&self, 0, sizeof(self));
+    self.sin_family = AF_INET; self.sin_addr.s_addr = INADDR_ANY; self.sin_port = htons(port);
+    if(bind(sock, (struct sockaddr *)&self, sizeof(self)) < 0) { perror("bind"); return 1; }
+    int rcvbuf = 4 << 20;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    struct timeval tv = {0, 10000};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    printf("Relay on port %d\n", port);
+
+    static uint8_t in_buf[BATCH][64];
+    struct mmsghdr msgs[BATCH];
+    struct iovec iov[BATCH];
+    struct sockaddr_in from[BATCH];
+    uint64_t start = now_ns(), next_stats = start + (uint64_t)stats_s * 1000000000ull;
+
+    while(running) {
+        for(int i = 0; i < BATCH; i++) {
+            iov[i].iov_base = in_buf[i]; iov[i].iov_len = sizeof(in_buf[i]);
+            memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+            msgs[i].msg_hdr.msg_iov = &iov[i]; msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &from[i]; msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+        }
+        // Blocks for the first datagram (up to the socket timeout), then takes whatever is queued
+        int n = recvmmsg(sock, msgs, BATCH, MSG_WAITFORONE, NULL);
+        uint64_t now = now_ns();
+        if(n > 0) {
+            rx_pkts += n; rx_batches++;
+            for(int i = 0; i < n; i++) handle(sock, in_buf[i], msgs[i].msg_len, now);
+        }
+        expire(sock, now);
+        if(out_n) flush_out(sock);
+
+        if(stats_s > 0 && now >= next_stats) {
+            print_stats((now - start) / 1e9);
+            next_stats = now + (uint64_t)stats_s * 1000000000ull;
+        }
+    }
+
+    printf("\n=== RELAY ===\n");
+    print_stats((now_ns() - start) / 1e9);
+    if(verbose) {
+        printf("%-32s %-21s %5s %8s %8s %8s %6s %6s %8s %8s\n",
+               "system", "W", "ref", "from U", "to W", "acked", "resent", "lost", "replaced", "rtt ms");
+        for(int i = 0; i < MAX_FLOWS; i++) {
+            Flow *f = &flows[i];
+            if(!f->used) continue;
+            char hex[2 * ID_LEN + 1], w[32];
+            for(int k = 0; k < ID_LEN; k++) sprintf(hex + 2 * k, "%02x", f->id[k]);
+            snprintf(w, sizeof(w), "%s:%d", inet_ntoa(f->w.sin_addr), ntohs(f->w.sin_port));
+            printf("%s %-21s %5d %8u %8u %8u %6u %6u %8u %8.3f\n", hex, w, f->angle, f->from_u, f->to_w,
+                   f->acked, f->resent, f->lost, f->replaced, f->acked ? f->rtt_ns / 1e6 / f->acked : 0.0);
+        }
+    }
+    close(sock);
+    return 0;
+}
@@ -0,0 +1,200 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdint.h>
+
+// Synthetic U and W endpoints for load-testing Relay/relay.c over loopback.
+//  U side: -n sensor systems, each with its own SYSTEM_ID, send MSG_FROM_U to the relay at -r packets/s
+//          (round robin). System i always reports angle i % ref, so the expected diff is known.
+//  W side: listens on -w, checks every MSG_TO_W against the expected diff and ACKs it (dropping -l %
+//          of them unanswered, to exercise the relay's resends).
+// Start the relay with the same reference angle and this W as the default:
+//   ./relay -w 127.0.0.1:8822 -a 512 &   ./uwsim -n 5000 -r 200000 -d 5
+
+#define PORT_E      12316
+#define PORT_W      8822
+#define MSG_FROM_U  0x01
+#define MSG_TO_W    0x02
+#define MSG_ACK     0x03
+#define PKT_LEN     31
+#define ID_OFF      15
+#define ID_LEN      16
+#define BATCH       64
+#define MAX_SYSTEMS (1 << 16)
+
+int systems = 1000, ref_angle = 512, loss_pct = 0;
+uint32_t *seen;                     // MSG_TO_W per system at W
+
+long u_sent = 0, w_got = 0, w_ok = 0, w_bad = 0, w_dropped = 0, w_acked = 0;
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// SYSTEM_ID of system i: a fixed tag, scrambled middle bytes (so IDs do not share a hash pattern), the index
+void make_id(uint8_t *id, uint32_t i) {
+    uint64_t h = (i + 1) * 0x9E3779B97F4A7C15ull;
+    h ^= h >> 29;
+    memcpy(id, "UWSI", 4);
+    memcpy(id + 4, &h, 8);
+    id[12] = i >> 24; id[13] = i >> 16; id[14] = i >> 8; id[15] = i;
+}
+
+int id_index(const uint8_t *id) {
+    uint8_t want[ID_LEN];
+    uint32_t i = ((uint32_t)id[12] << 24) | (id[13] << 16) | (id[14] << 8) | id[15];
+    if(i >= (uint32_t)systems) return -1;
+    make_id(want, i);
+    return memcmp(want, id, ID_LEN) == 0 ? (int)i : -1;
+}
+
+int angle_of(int i) { return i % ref_angle; }
+
+void send_batch(int sock, uint8_t buf[][PKT_LEN], struct sockaddr_in *to, int n) {
+    struct mmsghdr msgs[BATCH];
+    struct iovec iov[BATCH];
+    memset(msgs, 0, sizeof(msgs[0]) * n);
+    for(int i = 0; i < n; i++) {
+        iov[i].iov_base = buf[i]; iov[i].iov_len = PKT_LEN;
+        msgs[i].msg_hdr.msg_iov = &iov[i]; msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &to[i]; msgs[i].msg_hdr.msg_namelen = sizeof(to[i]);
+    }
+    for(int sent = 0; sent < n; ) {
+        int k = sendmmsg(sock, msgs + sent, n - sent, 0);
+        if(k <= 0) break;
+        sent += k;
+    }
+}
+
+// U side: the next n readings, round robin over the systems
+void send_u(int sock, const struct sockaddr_in *relay, int n) {
+    static uint32_t next;
+    uint8_t buf[BATCH][PKT_LEN];
+    struct sockaddr_in to[BATCH];
+    for(int k = 0; k < n; k++) {
+        int i = next++ % systems;
+        uint16_t a = angle_of(i);
+        memset(buf[k], 0, PKT_LEN);
+        buf[k][0] = MSG_FROM_U;
+        buf[k][7] = a >> 8; buf[k][8] = a & 0xFF;
+        make_id(&buf[k][ID_OFF], i);
+        to[k] = *relay;
+    }
+    send_batch(sock, buf, to, n);
+    u_sent += n;
+}
+
+// W side: everything queued right now. Returns the number of datagrams read.
+int serve_w(int sock) {
+    static uint8_t in[BATCH][64];
+    struct mmsghdr msgs[BATCH];
+    struct iovec iov[BATCH];
+    struct sockaddr_in from[BATCH], to[BATCH];
+    uint8_t out[BATCH][PKT_LEN];
+    for(int i = 0; i < BATCH; i++) {
+        iov[i].iov_base = in[i]; iov[i].iov_len = sizeof(in[i]);
+        memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+        msgs[i].msg_hdr.msg_iov = &iov[i]; msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &from[i]; msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+    }
+    int n = recvmmsg(sock, msgs, BATCH, MSG_DONTWAIT, NULL);
+    if(n <= 0) return 0;
+
+    int acks = 0;
+    for(int k = 0; k < n; k++) {
+        const uint8_t *p = in[k];
+        if(msgs[k].msg_len < PKT_LEN || p[0] != MSG_TO_W) { w_bad++; continue; }
+        w_got++;
+        int i = id_index(&p[ID_OFF]);
+        uint16_t diff = (p[7] << 8) | p[8];
+        if(i < 0 || diff != ref_angle - angle_of(i)) { w_bad++; continue; }
+        w_ok++; seen[i]++;
+        if(loss_pct && rand() % 100 < loss_pct) { w_dropped++; continue; }
+
+        memset(out[acks], 0, PKT_LEN);
+        out[acks][0] = MSG_ACK;
+        memcpy(&out[acks][ID_OFF], &p[ID_OFF], ID_LEN);
+        to[acks++] = from[k];
+    }
+    if(acks) send_batch(sock, out, to, acks);
+    w_acked += acks;
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+    setvbuf(stdout, NULL, _IONBF, 0);
+    const char *relay_addr = "127.0.0.1";
+    int w_port = PORT_W, rate = 100000, drain_ms = 1000;
+    double duration = 5;
+    int opt;
+    while((opt = getopt(argc, argv, "e:w:n:r:d:a:l:t:")) != -1) {
+        if(opt == 'e') relay_addr = optarg;
+        else if(opt == 'w') w_port = atoi(optarg);
+        else if(opt == 'n') systems = atoi(optarg);
+        else if(opt == 'r') rate = atoi(optarg);
+        else if(opt == 'd') duration = atof(optarg);
+        else if(opt == 'a') ref_angle = atoi(optarg);
+        else if(opt == 'l') loss_pct = atoi(optarg);
+        else if(opt == 't') drain_ms = atoi(optarg);
+        else {
+            printf("Usage: %s [-e relay_ip[:port]] [-w W port] [-n systems] [-r U packets/s] [-d s] [-a ref angle] [-l W loss %%] [-t drain ms]\n", argv[0]);
+            return 1;
+        }
+    }
+    if(systems < 1 || systems > MAX_SYSTEMS || ref_angle < 1 || rate < 1) { printf("Bad arguments\n"); return 1; }
+    seen = calloc(systems, sizeof(*seen));
+
+    struct sockaddr_in relay;
+    char ip[64]; int port = PORT_E;
+    sscanf(relay_addr, "%63[^:]:%d", ip, &port);
+    memset(&relay, 0, sizeof(relay));
+    relay.sin_family = AF_INET; relay.sin_port = htons(port);
+    if(inet_pton(AF_INET, ip, &relay.sin_addr) != 1) { printf("Bad relay address %s\n", relay_addr); return 1; }
+
+    int u_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    int w_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in w;
+    memset(&w, 0, sizeof(w));
+    w.sin_family = AF_INET; w.sin_addr.s_addr = INADDR_ANY; w.sin_port = htons(w_port);
+    if(bind(w_sock, (struct sockaddr *)&w, sizeof(w)) < 0) { perror("bind W"); return 1; }
+    int rcvbuf = 4 << 20;
+    setsockopt(w_sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    printf("U: %d systems -> %s:%d at %d/s for %.1fs, W on port %d (loss %d%%)\n",
+           systems, ip, port, rate, duration, w_port, loss_pct);
+    uint64_t start = now_ns(), end = start + (uint64_t)(duration * 1e9);
+    uint64_t now;
+    while((now = now_ns()) < end) {
+        long due = (long)((now - start) / 1e9 * rate) - u_sent;
+        while(due > 0) {
+            int n = due < BATCH ? due : BATCH;
+            send_u(u_sock, &relay, n);
+            due -= n;
+            serve_w(w_sock);
+        }
+        if(!serve_w(w_sock)) usleep(100);
+    }
+    // Resends and late readings still on their way
+    uint64_t drain_end = now_ns() + (uint64_t)drain_ms * 1000000ull;
+    while(now_ns() < drain_end)
+        if(!serve_w(w_sock)) usleep(1000);
+
+    int reached = 0;
+    for(int i = 0; i < systems; i++) reached += seen[i] > 0;
+    double secs = (now_ns() - start) / 1e9;
+    printf("\n=== UWSIM ===\n");
+    printf("U sent %ld MSG_FROM_U (%.0f/s)\n", u_sent, u_sent / duration);
+    printf("W got %ld MSG_TO_W in %.1fs: %ld correct, %ld bad, %d/%d systems reached\n",
+           w_got, secs, w_ok, w_bad, reached, systems);
+    printf("W sent %ld ACKs, left %ld unanswered\n", w_acked, w_dropped);
+    return w_bad ? 1 : 0;
+}
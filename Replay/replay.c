@@ -0,0 +1,219 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include "../Common/trace.h"
+
+// Replays a packet trace recorded with ALP_TRACE=<file> (Common/trace.h, one file per process).
+//  server trace: the replayer plays every node and drives a live server
+//  node trace:   (-n) the replayer plays the server and the peers and drives a live node
+// Before each recorded incoming datagram is injected, the replayer waits until the target has
+// sent as many datagrams as it did in the recording (bounded by -w), so stop-and-wait exchanges
+// stay in step. HEARTBEATs are left out of that count: they go out on a timer, not in answer to
+// anything, and a faster replay sees fewer of them.
+// -s sets the pace: 1 = recorded timing, 10 = ten times faster, 0 = no pacing.
+// Record the replayed run with ALP_TRACE as well to compare two builds on the same input.
+
+#define PORT        8000
+#define MAX_PEERS   64
+#define MSG_ASSIGN  0x2
+#define MSG_HEARTBEAT 0xC
+
+const char *type_name[16] = { "?", "REGISTER", "ASSIGN", "DATA", "ACK", "REQUEST", "RESPONSE", "HANDOVER",
+                              "REQ_COORDS", "RESP_COORDS", "PASS", "PROGRESS", "HEARTBEAT", "FRAG", "?", "?" };
+
+uint8_t *map;
+size_t map_size;
+
+struct { uint32_t addr; uint16_t port; int sock; } peers[MAX_PEERS];
+int peer_count = 0;
+
+struct sockaddr_in target;
+int node_mode = 0, have_target = 0;
+int node_sock = -1;
+long got = 0, got_type[16];
+
+// --- TRACE ---
+int load_trace(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) < 0) { perror(path); return -1; }
+    map_size = st.st_size;
+    map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED || map_size < 8 || memcmp(map, TRACE_MAGIC, 8) != 0) {
+        printf("%s: not an ALP trace\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Offset of the first record of session s (1-based), 0 if there is no such session
+size_t find_session(int s) {
+    if(!trace_valid(map, map_size, 8)) return 0;
+    for(size_t off = 8; off; off = trace_next(map, map_size, off)) {
+        const TraceRec *r = (const TraceRec *)(map + off);
+        if(r->dir == TRACE_OPEN && --s == 0) return off;
+    }
+    return 0;
+}
+
+void dump(size_t from) {
+    const TraceRec *first = (const TraceRec *)(map + from);
+    for(size_t off = from; off; off = trace_next(map, map_size, off)) {
+        const TraceRec *r = (const TraceRec *)(map + off);
+        const uint8_t *d = (const uint8_t *)(r + 1);
+        double ms = (r->t_ns - first->t_ns) / 1e6;
+        if(r->dir == TRACE_OPEN) { printf("%10.3f  ==== session %.*s\n", ms, (int)r->len, (const char *)d); continue; }
+
+        struct in_addr a = { r->addr };
+        printf("%10.3f  %s %15s:%-5d %-11s %4u ", ms, r->dir == TRACE_TX ? "TX ->" : "RX <-",
+               inet_ntoa(a), ntohs(r->port), type_name[d[0] & 0x0F], r->len);
+        for(uint32_t i = 0; i < r->len && i < 12; i++) printf(" %02x", d[i]);
+        printf("\n");
+    }
+}
+
+// --- NETWORK ---
+// Server mode: one socket per recorded node, so the server sees as many distinct nodes
+int peer_sock(const TraceRec *r) {
+    for(int i = 0; i < peer_count; i++)
+        if(peers[i].addr == r->addr && peers[i].port == r->port) return peers[i].sock;
+    if(peer_count == MAX_PEERS) return peers[0].sock;
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    peers[peer_count].addr = r->addr; peers[peer_count].port = r->port; peers[peer_count].sock = s;
+    peer_count++;
+    return s;
+}
+
+// Counts everything the target sent until timeout_ms passes (0 = just drain)
+void pump(int timeout_ms) {
+    struct pollfd pfd[MAX_PEERS];
+    int n = 0;
+    if(node_mode) { pfd[n].fd = node_sock; pfd[n++].events = POLLIN; }
+    else for(int i = 0; i < peer_count; i++) { pfd[n].fd = peers[i].sock; pfd[n++].events = POLLIN; }
+
+    if(poll(pfd, n, timeout_ms) <= 0) return;
+    for(int i = 0; i < n; i++) {
+        if(!(pfd[i].revents & POLLIN)) continue;
+        uint8_t buf[65536];
+        struct sockaddr_in from; socklen_t l = sizeof(from);
+        int len = recvfrom(pfd[i].fd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&from, &l);
+        if(len <= 0) continue;
+        if(node_mode && !have_target) { target = from; have_target = 1; }
+        got_type[buf[0] & 0x0F]++;
+        if((buf[0] & 0x0F) != MSG_HEARTBEAT) got++;
+    }
+}
+
+// Node mode: the peer table in ASSIGN points at the replayer, so the node's PASS comes back here
+void rewrite_assign(uint8_t *p, int len, const struct sockaddr_in *self) {
+    if(len < 11 || (p[0] & 0x0F) != MSG_ASSIGN) return;
+    for(int pos = 10; pos + 11 <= len - 1; pos += 11) {
+        memcpy(&p[pos + 5], &self->sin_addr.s_addr, 4);
+        memcpy(&p[pos + 9], &self->sin_port, 2);
+    }
+    uint8_t crc = 0;
+    for(int i = 0; i < len - 1; i++) crc += p[i];
+    p[len - 1] = crc;
+}
+
+// --- MAIN ---
+int main(int argc, char *argv[]) {
+    setvbuf(stdout, NULL, _IONBF, 0);
+    double speed = 1.0;
+    int session = 1, wait_ms = 1000, dump_only = 0;
+    const char *addr = "127.0.0.1:8000";
+    int opt;
+    while((opt = getopt(argc, argv, "dns:S:t:w:")) != -1) {
+        if(opt == 'd') dump_only = 1;
+        else if(opt == 'n') node_mode = 1;
+        else if(opt == 's') speed = atof(optarg);
+        else if(opt == 'S') session = atoi(optarg);
+        else if(opt == 't') addr = optarg;
+        else if(opt == 'w') wait_ms = atoi(optarg);
+        else optind = argc + 1;
+    }
+    if(optind != argc - 1) {
+        printf("Usage: %s [-d] [-n] [-s speed] [-S session] [-t ip:port] [-w ms] <trace>\n"
+               "  -d  print the trace and exit\n"
+               "  -n  node trace: play the server (port %d) for one node; -t is where its peers are\n"
+               "  -s  1 = recorded timing (default), N = N times faster, 0 = as fast as the target answers\n"
+               "  -S  session to replay (default 1)\n"
+               "  -t  server mode: server address (default 127.0.0.1:8000)\n"
+               "  -w  ms to wait for the target before injecting anyway (default 1000)\n", argv[0], PORT);
+        return 1;
+    }
+    if(load_trace(argv[optind]) < 0) return 1;
+    size_t from = find_session(session);
+    if(!from) { printf("No session %d in trace\n", session); return 1; }
+    if(dump_only) { dump(from); return 0; }
+
+    struct sockaddr_in t;
+    char ip[64]; int port = PORT;
+    if(sscanf(addr, "%63[^:]:%d", ip, &port) < 1) { printf("Bad address %s\n", addr); return 1; }
+    memset(&t, 0, sizeof(t));
+    t.sin_family = AF_INET; t.sin_port = htons(port);
+    inet_pton(AF_INET, ip, &t.sin_addr);
+
+    if(node_mode) {
+        struct sockaddr_in self;
+        memset(&self, 0, sizeof(self));
+        self.sin_family = AF_INET; self.sin_addr.s_addr = INADDR_ANY; self.sin_port = htons(PORT);
+        node_sock = socket(AF_INET, SOCK_DGRAM, 0);
+        if(bind(node_sock, (struct sockaddr *)&self, sizeof(self)) < 0) { perror("bind"); return 1; }
+        printf("Playing the server; start the node now...\n");
+    } else {
+        target = t; have_target = 1;
+    }
+
+    const TraceRec *first = (const TraceRec *)(map + from);
+    uint64_t start = trace_now(), last_t = first->t_ns;
+    long injected = 0, expected = 0, stalls = 0, exp_type[16] = {0};
+
+    for(size_t off = trace_next(map, map_size, from); off; off = trace_next(map, map_size, off)) {
+        const TraceRec *r = (const TraceRec *)(map + off);
+        if(r->dir == TRACE_OPEN) break;
+        const uint8_t *d = (const uint8_t *)(r + 1);
+        last_t = r->t_ns;
+        if(r->dir == TRACE_TX) {
+            exp_type[d[0] & 0x0F]++;
+            if((d[0] & 0x0F) != MSG_HEARTBEAT) expected++;
+            continue;
+        }
+
+        // The recorded process had answered `expected` times before this datagram arrived
+        uint64_t deadline = trace_now() + (uint64_t)wait_ms * 1000000;
+        while(got < expected && trace_now() < deadline) pump(5);
+        if(got < expected) { stalls++; got = expected; }
+        if(speed > 0) {
+            uint64_t due = start + (uint64_t)((r->t_ns - first->t_ns) / speed);
+            while(trace_now() < due) pump((int)((due - trace_now()) / 1000000) + 1);
+        }
+        if(!have_target) { printf("Node never contacted the replayer\n"); return 1; }
+
+        uint8_t pkt[65536];
+        memcpy(pkt, d, r->len);
+        if(node_mode) rewrite_assign(pkt, r->len, &t);
+        sendto(node_mode ? node_sock : peer_sock(r), pkt, r->len, 0, (struct sockaddr *)&target, sizeof(target));
+        injected++;
+        pump(0);
+    }
+    uint64_t deadline = trace_now() + (uint64_t)wait_ms * 1000000;
+    while(got < expected && trace_now() < deadline) pump(5);
+
+    printf("\n=== REPLAY ===\n");
+    printf("Injected %ld datagrams, %d peers, %.1f ms (recorded %.1f ms), %ld stalls\n", injected,
+           node_mode ? 1 : peer_count, (trace_now() - start) / 1e6, (last_t - first->t_ns) / 1e6, stalls);
+    printf("%-12s %9s %9s\n", "type", "recorded", "replayed");
+    for(int i = 0; i < 16; i++)
+        if(exp_type[i] || got_type[i]) printf("%-12s %9ld %9ld\n", type_name[i], exp_type[i], got_type[i]);
+    return 0;
+}
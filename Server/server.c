@@ -8,55 +8,129 @@
 #include <netinet/in.h>
 #include <sys/time.h>
 #include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "../Common/turtle.h"
+#include "../Common/cmdstream.h"
+#include "../Common/trace.h"
+#include "../Common/frag.h"
+#include "../Common/span.h"
+#include "../Common/caps.h"
 
 // CONFIG
 #define ALP_VERSION      1
-#define MSG_REGISTER     0x1
+#define MSG_REGISTER     0x1     // server -> node without payload: "register again"
 #define MSG_ASSIGN       0x2
 #define MSG_DATA         0x3
 #define MSG_ACK          0x4
 #define MSG_REQUEST      0x5
 #define MSG_RESPONSE     0x6
 #define MSG_HANDOVER     0x7
+#define MSG_PASS         0xA
+#define MSG_PROGRESS     0xB
+#define MSG_HEARTBEAT    0xC     // node -> server, no reply; idle nodes send it every HEARTBEAT_US
+#define REGION_ALL       0xFF    // REQUEST row meaning "the whole region"
+#define ASSIGN_KEEP      0x80    // ASSIGN peer-count flag: new peer table only, the node keeps its grid
 
 #define PORT 8000
 #define MAX_STR    100000
 #define GRID_WIDTH  40
 #define GRID_HEIGHT 40
-#define NODE_WIDTH  20
-#define NODE_HEIGHT 20
 #define MAX_NODES   4 
-#define MY_PI 3.1415926535
+#define MAX_THREADS 16          // workers of the local backend (ALP_THREADS=n)
+#define MAX_STANDBY 4           // spare nodes (ALP_STANDBY=n) that take over a lost node's region
+#define CHUNK_MIN   16          // a chunk cut at the predicted region exit is never shorter
+#define DEFAULT_RXBUF 256       // receive buffer of a node that does not advertise one
+#define MAX_STACK   64
+#define MAX_RUNS    (MAX_STR/2 + 1)
+#define RETRIES     5
+#define RETRY_US    400000
+#define CKPT_US     250000      // a working node's grid is pulled at most this often
+#define HEARTBEAT_US 500000     // node heartbeat period (Node/node.c)
+#define LIVENESS_US 2000000     // an idle node silent this long is gone
+#define START_GRACE_US 500000   // once ALP_QUORUM nodes are in, stragglers get this long
+#define NODE_CELLS  (32*32)     // grid capacity of a node that does not say (MAX_REGION^2 in Node/node.c)
+#define HISTORY_WEIGHT 0.25
+#define DENSITY_FILE "density.map"
 
 typedef struct {
     uint8_t node_id;
     struct sockaddr_in addr;
-    int rx, ry; 
+    int rx, ry, rw, rh; 
+    int dgram;          // largest datagram for this node: min(receive buffer, path MTU)
+    int cells;          // grid capacity, from REGISTER (Common/caps.h)
+    int enc;            // CAPS_ENC_* it decodes
+    int kcps;           // measured speed, 1000 commands/s (0 = unknown)
+    struct timeval seen;    // last datagram from it
 } Node;
 
 Node nodes[MAX_NODES];
 int node_count = 0;
+Node standby[MAX_STANDBY];
+int standby_count = 0;
+int upstream = 0;       // sub-server: the canvas ends at the region the upstream server assigned
+int in_job = 0;         // nodes that register now wait in standby[] for the next job
+int area_x = 0, area_y = 0, area_w = GRID_WIDTH, area_h = GRID_HEIGHT;   // canvas of the job (sub-server: from ASSIGN)
+int up_fd = -1, up_id = 0, up_start = 0;    // sub-server: upstream socket while a DATA is drawn here (-1 = none)
+uint8_t up_tag[2];                          // and that DATA's tag; it started at str[up_start]
+struct sockaddr_in up_addr;
+int quorum = MAX_NODES/2 + 1, want_standby = 0;
 char global_grid[GRID_HEIGHT][GRID_WIDTH]; 
 
 // L-System Structs
 typedef struct { char symbol; char replacement[MAX_STR]; } Rule;
 typedef struct { char axiom[MAX_STR]; int iterations; int angle; Rule rules[16]; int rule_count; } LSystem;
 
-// --- MANUAL MATH ---
-double normalize_angle(double x) {
-    while (x > MY_PI) x -= 2 * MY_PI;
-    while (x < -MY_PI) x += 2 * MY_PI;
-    return x;
-}
-double my_sin(double x) {
-    x = normalize_angle(x);
-    double x2 = x * x;
-    double res = x;
-    res += -x * x2 / 6.0;
-    res += x * x2 * x2 / 120.0;
-    return res;
-}
-double my_cos(double x) { return my_sin(x + MY_PI / 2.0); }
+// Branch = bracket-free span of the final string. Entry state comes from the pre-trace,
+// so branches are independent and can be streamed to different nodes at the same time.
+typedef struct {
+    int idx, end;       // next command to send, end of span
+    Turtle t;           // turtle state at idx
+    int next;           // node queue link
+} Run;
+
+typedef struct {
+    int run;            // -1 = idle
+    int chunk;
+    uint16_t tag;       // sequence number of the chunk, echoed in ACK, HANDOVER and PROGRESS
+    int tries;
+    int holder;         // node the turtle is with (changes on PROGRESS)
+    int progress;       // commands done when it got there
+    unsigned passed;    // nodes that have passed it on at that progress (bitmask)
+    struct timeval sent;
+    uint64_t t0;        // first send, for the chunk span
+    int len;
+    uint8_t pkt[21 + CMD_MAX_TOK];
+} Flight;
+
+// Completed chunk: the state before it and its command span are enough to draw it again
+typedef struct {
+    int idx, count;
+    Turtle t;
+} Done;
+
+// Checkpoint: the node's grid merged into global_grid, covering done_log[0..covers)
+typedef struct {
+    int covers;
+    int pending;        // log position of the REQUEST in flight, -1 = none
+    struct timeval sent;
+    Reasm reasm;
+} Ckpt;
+
+Run runs[MAX_RUNS];
+int run_count = 0;
+Done *done_log;
+int log_count = 0, log_cap = 0;
+Ckpt ckpt[MAX_NODES];
+int q_head[MAX_NODES], q_tail[MAX_NODES];
+Flight flight[MAX_NODES];
+uint16_t chunk_seq = 0;
+long sent_cmds = 0, sent_chunks = 0;
+
+float density[GRID_HEIGHT][GRID_WIDTH];    // F landings of the current job (pre-trace)
+float history[GRID_HEIGHT][GRID_WIDTH];    // earlier jobs, kept in DENSITY_FILE
 
 // --- NETWORK ---
 uint8_t alp_crc(uint8_t *buf, int len) {
@@ -72,21 +146,316 @@ void pack_header(uint8_t *buf, int type, int node_id, int payload_len) {
 }
 void send_ack(int sockfd, struct sockaddr_in *dest) {
     uint8_t buf[5]; pack_header(buf, MSG_ACK, 0, 0); buf[4] = alp_crc(buf, 4);
-    sendto(sockfd, buf, 5, 0, (struct sockaddr *)dest, sizeof(*dest));
+    trace_sendto(sockfd, buf, 5, 0, (struct sockaddr *)dest, sizeof(*dest));
+}
+
+int node_by_id(int id) {
+    for(int i=0; i<node_count; i++) if(nodes[i].node_id == id) return i;
+    return -1;
+}
+
+int node_by_addr(struct sockaddr_in *a) {
+    for(int i=0; i<node_count; i++)
+        if(nodes[i].addr.sin_addr.s_addr == a->sin_addr.s_addr && nodes[i].addr.sin_port == a->sin_port) return i;
+    return -1;
+}
+
+long elapsed_us(struct timeval *t) {
+    struct timeval now; gettimeofday(&now, NULL);
+    return (now.tv_sec - t->tv_sec) * 1000000L + (now.tv_usec - t->tv_usec);
+}
+
+// --- MEMBERSHIP ---
+// Every datagram from a node is a sign of life and idle nodes send MSG_HEARTBEAT, so a node that
+// stays silent for LIVENESS_US is gone. A node may register at any time: between jobs it joins
+// the fleet at once, during a job it waits in standby[] (a spare for failover) until the next
+// job starts (rebalance). A REGISTER for a known ID from a new address is a restarted node: the
+// old entry goes silent and is dropped like a dead node. A heartbeat from an address that is not
+// a member (dropped while it was only slow, or this server restarted) is answered with an empty
+// REGISTER, and the node registers again.
+Node *member_by_addr(struct sockaddr_in *a) {
+    int i = node_by_addr(a);
+    if(i >= 0) return &nodes[i];
+    for(i=0; i<standby_count; i++)
+        if(standby[i].addr.sin_addr.s_addr == a->sin_addr.s_addr && standby[i].addr.sin_port == a->sin_port) return &standby[i];
+    return NULL;
+}
+
+Node *member_by_id(int id) {
+    int i = node_by_id(id);
+    if(i >= 0) return &nodes[i];
+    for(i=0; i<standby_count; i++) if(standby[i].node_id == id) return &standby[i];
+    return NULL;
+}
+
+int silent(Node *nd) { return elapsed_us(&nd->seen) > LIVENESS_US; }
+
+void handle_register(int sockfd, uint8_t *buf, int n, struct sockaddr_in *cli) {
+    uint8_t id = buf[1];
+    Node *nd = member_by_addr(cli);
+    if(nd && nd->node_id == id) { send_ack(sockfd, cli); return; }     // our ACK was lost
+
+    // REGISTER payload: capabilities (Common/caps.h)
+    Caps caps;
+    int plen = (buf[2]<<8) | buf[3];
+    caps_get(&buf[4], plen < n-5 ? plen : n-5, DEFAULT_RXBUF, NODE_CELLS, &caps);
+    if(!(caps.enc & CAPS_ENC_STREAM)) { printf("Node %d cannot decode the command stream, ignored\n", id); return; }
+    int mtu = path_mtu(cli), dgram = caps.rxbuf < mtu ? caps.rxbuf : mtu;
+    // Same floor as the path MTU (Common/frag.h): room for the DATA/PASS headers and commands
+    if(dgram < MIN_DGRAM) { printf("Node %d takes only %d-byte datagrams, ignored\n", id, dgram); return; }
+
+    Node *old = member_by_id(id);
+    if(old && old >= standby && old < standby + MAX_STANDBY) nd = old;
+    else {
+        if(old) {
+            printf("Node %d restarted\n", id);
+            memset(&old->seen, 0, sizeof(old->seen));
+        }
+        if(!in_job && node_count < MAX_NODES) {
+            nd = &nodes[node_count++];
+            char lane[16]; snprintf(lane, sizeof(lane), "Node %d", id);
+            span_lane(node_count, lane);
+        }
+        else if(standby_count < MAX_STANDBY) nd = &standby[standby_count++];
+        else { printf("Node %d: no room, ignored\n", id); return; }
+    }
+    nd->node_id = id;
+    nd->addr = *cli;
+    nd->dgram = dgram;
+    nd->cells = caps.cells;
+    nd->enc = caps.enc;
+    nd->kcps = caps.kcps;
+    gettimeofday(&nd->seen, NULL);
+    send_ack(sockfd, cli);
+    printf("Node %d Reg%s. Port %d, rx buffer %d, path MTU %d, %d cells, %d kcmd/s\n", id, nd >= standby && nd < standby + MAX_STANDBY ? " (standby)" : "",
+           ntohs(cli->sin_port), caps.rxbuf, mtu, caps.cells, caps.kcps);
 }
 
+// recvfrom for the node socket: notes who is alive and takes REGISTER whenever it comes.
+// The caller still sees every datagram (REGISTER and HEARTBEAT are just not its business).
+int recv_alp(int sockfd, uint8_t *buf, int max, struct sockaddr_in *cli) {
+    socklen_t l = sizeof(*cli);
+    int n = trace_recvfrom(sockfd, buf, max, 0, (struct sockaddr*)cli, &l);
+    if(n < 5) return n;
+    Node *nd = member_by_addr(cli);
+    if(nd) gettimeofday(&nd->seen, NULL);
+    if((buf[0]&0x0F) == MSG_REGISTER) handle_register(sockfd, buf, n, cli);
+    else if(!nd && (buf[0]&0x0F) == MSG_HEARTBEAT) {
+        uint8_t rq[5]; pack_header(rq, MSG_REGISTER, 0, 0); rq[4] = alp_crc(rq, 4);
+        trace_sendto(sockfd, rq, 5, 0, (struct sockaddr*)cli, sizeof(*cli));
+    }
+    return n;
+}
+
+// Everything queued since the socket was last read, without waiting: between jobs nobody reads
+// it, and the heartbeats waiting there are what tells a live node from a dead one
+void drain(int sockfd) {
+    int fl = fcntl(sockfd, F_GETFL);
+    fcntl(sockfd, F_SETFL, fl | O_NONBLOCK);
+    struct sockaddr_in cli; uint8_t buf[FRAG_MAX];
+    while(recv_alp(sockfd, buf, sizeof(buf), &cli) >= 0);
+    fcntl(sockfd, F_SETFL, fl);
+}
+
+// Removes silent members from set. Returns how many went.
+int drop_silent(Node *set, int *count) {
+    int k = 0, gone = 0;
+    for(int i=0; i<*count; i++) {
+        if(silent(&set[i])) { printf("Node %d silent for %ld ms, dropped\n", set[i].node_id, elapsed_us(&set[i].seen) / 1000); gone++; }
+        else set[k++] = set[i];
+    }
+    *count = k;
+    return gone;
+}
+
+void partition(Node *set, int x, int y, int w, int h, int first, int k);
+
+// Grid cells the fleet holds together
+int fleet_cells() {
+    int c = 0;
+    for(int i=0; i<node_count; i++) c += nodes[i].cells;
+    return c;
+}
+
+// Whether the fleet's grids hold the rectangle: the split is tried on a copy, every region must fit
+// its node's cells (a node clips a bigger one and its rows are lost). The split reads density[],
+// so only with the job prepared.
+int fleet_fits(int x, int y, int w, int h) {
+    if(w * h == 0) return 1;
+    if(node_count == 0) return 0;
+    Node set[MAX_NODES];
+    memcpy(set, nodes, node_count * sizeof(Node));
+    partition(set, x, y, w, h, 0, node_count);
+    for(int i=0; i<node_count; i++)
+        if(set[i].rw * set[i].rh > set[i].cells) return 0;
+    return 1;
+}
+
+// Waits until the fleet is complete, or ALP_QUORUM nodes are in, their grids hold at least
+// `cells` together and no more came for START_GRACE_US
+void wait_fleet(int sockfd, int cells) {
+    SPAN("wait_fleet");
+    struct timeval tv = {0, 50000}, last;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+    gettimeofday(&last, NULL);
+    int had = node_count;
+    while(node_count < MAX_NODES || standby_count < want_standby) {
+        if(node_count != had) { had = node_count; gettimeofday(&last, NULL); }
+        if(node_count >= quorum && elapsed_us(&last) >= START_GRACE_US && fleet_cells() >= cells) break;
+        struct sockaddr_in cli; uint8_t buf[256];
+        recv_alp(sockfd, buf, sizeof(buf), &cli);
+    }
+}
+
+// Rebalance point, before every job on the w x h canvas at x,y: the dead leave, nodes that joined
+// during the last job fill the free slots, and below the quorum or the canvas size the job waits for more.
+void rebalance(int sockfd, int x, int y, int w, int h) {
+    drain(sockfd);
+    int changed = drop_silent(nodes, &node_count) + drop_silent(standby, &standby_count);
+    while(node_count < MAX_NODES && standby_count > 0) {
+        nodes[node_count++] = standby[--standby_count];
+        printf("Node %d joins the fleet\n", nodes[node_count-1].node_id);
+        changed = 1;
+    }
+    if(node_count < quorum) { printf("%d nodes, waiting for a quorum of %d...\n", node_count, quorum); wait_fleet(sockfd, w * h); changed = 1; }
+    // Enough cells in total may still not split into regions that fit: then more nodes are needed
+    if(node_count < MAX_NODES && !fleet_fits(x, y, w, h)) {
+        printf("%d nodes cannot hold %dx%d, waiting for more...\n", node_count, w, h);
+        do wait_fleet(sockfd, w * h); while(node_count < MAX_NODES && !fleet_fits(x, y, w, h));
+        changed = 1;
+    }
+    if(!changed) return;
+    for(int i=0; i<node_count; i++) {
+        char lane[16]; snprintf(lane, sizeof(lane), "Node %d", nodes[i].node_id);
+        span_lane(1 + i, lane);
+    }
+    printf("Fleet: %d nodes, %d standby\n", node_count, standby_count);
+}
+
+// Node owning a cell, -1 outside the canvas
 int get_node_idx(int x, int y) {
-    if(x<0) x=0; if(x>=GRID_WIDTH) x=GRID_WIDTH-1;
-    if(y<0) y=0; if(y>=GRID_HEIGHT) y=GRID_HEIGHT-1;
-    int col = x / NODE_WIDTH;
-    int row = y / NODE_HEIGHT;
-    int target = (row * 2) + col + 1;
-    for(int i=0; i<node_count; i++) if(nodes[i].node_id == target) return i;
+    if(x<0 || x>=GRID_WIDTH || y<0 || y>=GRID_HEIGHT) return -1;
+    for(int i=0; i<node_count; i++)
+        if(x >= nodes[i].rx && x < nodes[i].rx + nodes[i].rw && y >= nodes[i].ry && y < nodes[i].ry + nodes[i].rh) return i;
     return -1;
 }
 
+// --- PARTITION ---
+void load_history() {
+    FILE *fp = fopen(DENSITY_FILE, "rb");
+    if(!fp) return;
+    if(fread(history, sizeof(history), 1, fp) != 1) memset(history, 0, sizeof(history));
+    fclose(fp);
+}
+
+void save_history() {
+    for(int y=0; y<GRID_HEIGHT; y++)
+        for(int x=0; x<GRID_WIDTH; x++) history[y][x] = 0.5f * (history[y][x] + density[y][x]);
+    FILE *fp = fopen(DENSITY_FILE, "wb");
+    if(!fp) return;
+    fwrite(history, sizeof(history), 1, fp);
+    fclose(fp);
+}
+
+// Share of the work for a node: its measured speed; nodes that did not measure count as the slowest
+double node_weight(const Node *nd) {
+    return nd->kcps > 0 ? nd->kcps : 1;
+}
+
+// Weighted k-d split: the rectangle goes to set[first, first+k). Cut across the longer side
+// so both halves get F work in proportion to their nodes' speed, without overflowing node grids.
+void partition(Node *set, int x, int y, int w, int h, int first, int k) {
+    if(k == 1 || (w < 2 && h < 2)) {
+        for(int i=first; i<first+k; i++) { set[i].rx=x; set[i].ry=y; set[i].rw=0; set[i].rh=0; }
+        set[first].rw = w; set[first].rh = h;
+        return;
+    }
+    int kl = k / 2;
+    double wl = 0, wr = 0;
+    int cl = 0, cr = 0;
+    for(int i=first; i<first+k; i++) {
+        if(i < first+kl) { wl += node_weight(&set[i]); cl += set[i].cells; }
+        else { wr += node_weight(&set[i]); cr += set[i].cells; }
+    }
+    double share = wl / (wl + wr);
+    int vertical = w >= h;
+    int len = vertical ? w : h, other = vertical ? h : w;
+
+    double line[GRID_WIDTH > GRID_HEIGHT ? GRID_WIDTH : GRID_HEIGHT];
+    double total = 0;
+    for(int i=0; i<len; i++) {
+        line[i] = 0;
+        for(int j=0; j<other; j++) {
+            int cx = vertical ? x+i : x+j, cy = vertical ? y+j : y+i;
+            line[i] += density[cy][cx] + HISTORY_WEIGHT * history[cy][cx];
+        }
+        total += line[i];
+    }
+
+    int lo = len - cr / other, hi = cl / other;
+    if(lo < 1) lo = 1;
+    if(hi > len-1) hi = len-1;
+    int cut = len * share;
+    if(cut < 1) cut = 1;
+    if(lo > hi) lo = hi = cut;
+
+    if(total > 0) {
+        double target = total * share, acc = 0, best = -1;
+        for(int i=0; i<hi; i++) {
+            acc += line[i];
+            double d = acc > target ? acc - target : target - acc;
+            if(i+1 >= lo && (best < 0 || d < best)) { best = d; cut = i+1; }
+        }
+    }
+    else if(cut < lo) cut = lo;
+    else if(cut > hi) cut = hi;
+
+    if(vertical) {
+        partition(set, x, y, cut, h, first, kl);
+        partition(set, x+cut, y, w-cut, h, first+kl, k-kl);
+    } else {
+        partition(set, x, y, w, cut, first, kl);
+        partition(set, x, y+cut, w, h-cut, first+kl, k-kl);
+    }
+}
+
+// ASSIGN payload: own region + angle, then the peer table [id rx ry rw rh ip(4) port(2)].
+// keep = only the peer table changed (a node was replaced), the node must not clear its grid.
+void assign_node(int sockfd, int i, int angle, int keep) {
+    uint64_t t0 = span_now();
+    uint8_t as[16 + MAX_NODES*11];
+    pack_header(as, MSG_ASSIGN, nodes[i].node_id, 6 + 11*node_count);
+    as[4]=nodes[i].rx; as[5]=nodes[i].ry;
+    as[6]=nodes[i].rw; as[7]=nodes[i].rh; as[8]=angle;
+    as[9]=node_count | (keep ? ASSIGN_KEEP : 0);
+    int pos = 10;
+    for(int j=0; j<node_count; j++) {
+        as[pos++]=nodes[j].node_id;
+        as[pos++]=nodes[j].rx; as[pos++]=nodes[j].ry;
+        as[pos++]=nodes[j].rw; as[pos++]=nodes[j].rh;
+        memcpy(&as[pos], &nodes[j].addr.sin_addr.s_addr, 4); pos += 4;
+        memcpy(&as[pos], &nodes[j].addr.sin_port, 2); pos += 2;
+    }
+    as[pos] = alp_crc(as, pos);
+
+    // Resent only after RETRY_US: a heartbeat is no reason to send it again. Only a plain ACK
+    // answers it; the ACK of a chunk carries the chunk's tag
+    for(int r=0; r<RETRIES; r++) {
+        struct timeval sent;
+        frag_send(sockfd, &nodes[i].addr, as, pos+1, nodes[i].dgram);
+        gettimeofday(&sent, NULL);
+        while(elapsed_us(&sent) < RETRY_US) {
+            struct sockaddr_in cli; uint8_t rb[256];
+            int n = recv_alp(sockfd, rb, sizeof(rb), &cli);
+            if(n==5 && (rb[0]&0x0F)==MSG_ACK && node_by_addr(&cli)==i) { span_complete("assign", t0, 1+i, r); return; }
+        }
+    }
+    printf("WARN: Node %d did not ACK ASSIGN\n", nodes[i].node_id);
+}
+
 // --- L-SYSTEM ---
 int load_lsystem(const char *f, LSystem *ls) {
+    SPAN("load_lsystem");
     FILE *fp = fopen(f, "r");
     if(!fp) return -1;
     char line[256]; ls->rule_count = 0;
@@ -104,178 +473,949 @@ int load_lsystem(const char *f, LSystem *ls) {
     fclose(fp); return 0;
 }
 void generate_lsystem(LSystem *ls, char *out) {
+    SPAN("generate_lsystem");
     char cur[MAX_STR], next[MAX_STR];
     strcpy(cur, ls->axiom);
     for(int i=0; i<ls->iterations; i++) {
-        next[0]=0;
-        for(int j=0; cur[j]; j++) {
+        int len=0, overflow=0;
+        for(int j=0; cur[j] && !overflow; j++) {
             int r = -1;
             for(int k=0; k<ls->rule_count; k++) if(cur[j]==ls->rules[k].symbol) r=k;
-            if(r!=-1) strcat(next, ls->rules[r].replacement);
-            else { int l=strlen(next); next[l]=cur[j]; next[l+1]=0; }
+            if(r!=-1) {
+                int rl = strlen(ls->rules[r].replacement);
+                if(len+rl >= MAX_STR) overflow=1;
+                else { memcpy(&next[len], ls->rules[r].replacement, rl); len+=rl; }
+            }
+            else if(len+1 >= MAX_STR) overflow=1;
+            else next[len++]=cur[j];
         }
+        next[len]=0;
+        if(overflow) { printf("L-System too large! Stopping at iter %d\n", i); break; }
         strcpy(cur, next);
     }
     strcpy(out, cur);
 }
 
-// --- MAIN ---
-int main(int argc, char *argv[]) {
-    if(argc<2) { printf("Usage: %s <file>\n", argv[0]); return 1; }
-    
-    LSystem ls; char final_str[MAX_STR];
-    memset(global_grid, '.', sizeof(global_grid));
-    load_lsystem(argv[1], &ls);
-    generate_lsystem(&ls, final_str);
-    printf("L-System: %lu chars\n", strlen(final_str));
+// --- TURTLE ---
+// A pending rem (F cut by a region boundary) is finished before the commands.
+void walk(const char *s, int from, int to, int angle, Turtle *t) {
+    if(t->rem) turtle_advance(t, FX_ONE);
+    for(int k=from; k<to; k++) {
+        char c = s[k];
+        if(c=='F') turtle_advance(t, FX_ONE);
+        else if(c=='+') turtle_turn(t, angle);
+        else if(c=='-') turtle_turn(t, -angle);
+    }
+}
 
-    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    struct sockaddr_in serv, cli;
-    memset(&serv, 0, sizeof(serv));
-    serv.sin_family = AF_INET; serv.sin_addr.s_addr = INADDR_ANY; serv.sin_port = htons(PORT);
-    bind(sockfd, (struct sockaddr*)&serv, sizeof(serv));
-
-    printf("Waiting for nodes...\n");
-    while(node_count < MAX_NODES) {
-        socklen_t len = sizeof(cli); uint8_t buf[256];
-        int n = recvfrom(sockfd, buf, sizeof(buf), 0, (struct sockaddr*)&cli, &len);
-        if(n>0 && (buf[0]&0x0F)==MSG_REGISTER) {
-            uint8_t id = buf[1];
-            int known=0;
-            for(int i=0;i<node_count;i++) if(nodes[i].node_id==id) known=1;
-            if(!known) {
-                nodes[node_count].node_id = id;
-                nodes[node_count].addr = cli;
-                nodes[node_count].rx = ((id-1)%2)*NODE_WIDTH;
-                nodes[node_count].ry = ((id-1)/2)*NODE_HEIGHT;
-                send_ack(sockfd, &cli);
-                
-                uint8_t as[32]; pack_header(as, MSG_ASSIGN, id, 6);
-                as[4]=nodes[node_count].rx; as[5]=nodes[node_count].ry;
-                as[6]=NODE_WIDTH; as[7]=NODE_HEIGHT; as[8]=ls.angle;
-                as[9]=alp_crc(as, 9);
-                sendto(sockfd, as, 10, 0, (struct sockaddr*)&cli, len);
-                printf("Node %d Reg. Region %d,%d. Port %d\n", id, nodes[node_count].rx, nodes[node_count].ry, ntohs(cli.sin_port));
-                node_count++;
+// Pre-trace with a turtle stack. Spans without 'F' only change state, so they are not sent.
+void split_runs(const char *s, int angle, Turtle t) {
+    SPAN("split_runs");
+    Turtle stack[MAX_STACK]; int sp = 0;
+    int start = 0, draws = 0;
+    Turtle entry = t;
+    run_count = 0;
+    for(int i=0; ; i++) {
+        char c = s[i];
+        if(c==0 || c=='[' || c==']') {
+            if(draws && run_count < MAX_RUNS) {
+                Run *r = &runs[run_count++];
+                r->idx = start; r->end = i;
+                r->t = entry;
+            }
+            if(c==0) break;
+            if(c=='[') {
+                if(sp < MAX_STACK) stack[sp++] = t;
+                else printf("WARN: Stack overflow at %d\n", i);
+            }
+            else if(sp > 0) t = stack[--sp];
+            start = i+1; draws = 0;
+            entry = t;
+        } else {
+            walk(s, i, i+1, angle, &t);
+            if(c=='F') {
+                int cx = t.x >> FX_SHIFT, cy = t.y >> FX_SHIFT;
+                draws = 1;
+                if(cx >= 0 && cx < GRID_WIDTH && cy >= 0 && cy < GRID_HEIGHT) density[cy][cx] += 1;
+            }
+        }
+    }
+}
+
+// --- SCHEDULER ---
+void enqueue(int n, int r) {
+    runs[r].next = -1;
+    if(q_head[n] < 0) q_head[n] = r; else runs[q_tail[n]].next = r;
+    q_tail[n] = r;
+}
+
+// Owner (by owner(x, y)) of the cell the run's turtle is in, -1 when the run is finished.
+// Off the canvas nothing is drawn, so the turtle is walked here until a move re-enters it.
+int next_owner(const char *s, int angle, Run *run, int (*owner)(int, int)) {
+    Turtle *t = &run->t;
+    int warned = 0;
+    while(run->idx < run->end || t->rem) {
+        int cx, cy;
+        turtle_cell(t, FX_ONE, &cx, &cy);
+        int n = owner(cx, cy);
+        if(n != -1) return n;
+        if(upstream) return -1;     // the turtle leaves this sub-canvas; upstream routes it on
+        if(!warned++) printf("WARN: Turtle OOB at %.2f,%.2f. Simulating blindly.\n", t->x / 65536.0, t->y / 65536.0);
+        if(!t->rem) {
+            char c = s[run->idx++];
+            if(c=='+') turtle_turn(t, angle);
+            else if(c=='-') turtle_turn(t, -angle);
+            if(c!='F') continue;
+            t->rem = REM_ONE;
+        }
+        if(!turtle_enter(t, FX_ONE, 0, 0, GRID_WIDTH, GRID_HEIGHT)) turtle_advance(t, FX_ONE);
+    }
+    return -1;
+}
+
+// Hand the run to the node owning its current position. Returns 1 when the run is finished.
+int route(const char *s, int angle, int r) {
+    int n = next_owner(s, angle, &runs[r], get_node_idx);
+    if(n < 0) return 1;
+    enqueue(n, r);
+    return 0;
+}
+
+// Chunk size per node: as many encoded bytes as the node's datagram takes, and no more commands
+// than the turtle is predicted to run before it leaves the region (unless that is very few;
+// then the node passes the rest on directly instead of costing a round trip).
+void send_chunk(int sockfd, const char *s, int n, int angle) {
+    SPAN("send");
+    Flight *f = &flight[n];
+    Run *run = &runs[f->run];
+    Node *nd = &nodes[n];
+    int chunk, len;
+    int budget = nd->dgram - 23;    // the same stream may travel on as PASS, 2 bytes longer
+    if(budget > CMD_MAX_TOK) budget = CMD_MAX_TOK;
+    int limit = run->end - run->idx;
+    // A chunk keeps the node busy for at most a quarter of the retry timeout
+    long most = (long)nd->kcps * RETRY_US / 4000;
+    if(most > 0 && limit > most) limit = most;
+    int inside = turtle_span_inside(&s[run->idx], limit, run->t, FX_ONE, angle, nd->rx, nd->ry, nd->rx + nd->rw, nd->ry + nd->rh);
+    if(inside >= CHUNK_MIN) limit = inside;
+
+    // Tag = chunk sequence number. The chunk may be finished by a neighbour, so replies are matched
+    // by tag; a late reply to an earlier chunk of the same run no longer matches anything.
+    // DATA = tag(2) state(12) count(2) + compressed commands
+    // Back-references only if every node decodes them: the chunk may be passed on unchanged
+    int refs = 1;
+    for(int i=0; i<node_count; i++) refs &= (nodes[i].enc & CAPS_ENC_REF) != 0;
+    uint8_t *pkt = f->pkt;
+    len = cmd_encode(&s[run->idx], limit, &pkt[20], budget, &chunk, refs);
+    f->chunk = chunk;
+    sent_cmds += chunk; sent_chunks++;
+    pack_header(pkt, MSG_DATA, nodes[n].node_id, 16 + len);
+    f->tag = ++chunk_seq;
+    f->progress = 0; f->passed = 0;
+    pkt[4] = f->tag >> 8; pkt[5] = f->tag & 0xFF;
+    turtle_put(&pkt[6], &run->t);
+    pkt[18] = (chunk >> 8) & 0xFF; pkt[19] = chunk & 0xFF;
+    pkt[4+16+len] = alp_crc(pkt, 4+16+len);
+    f->len = 5+16+len;
+    f->tries = 1;
+    f->t0 = span_now();
+    gettimeofday(&f->sent, NULL);
+    trace_sendto(sockfd, pkt, f->len, 0, (struct sockaddr*)&nodes[n].addr, sizeof(nodes[n].addr));
+}
+
+int flight_by_tag(uint8_t *p) {
+    int tag = (p[4] << 8) | p[5];
+    for(int i=0; i<node_count; i++) if(flight[i].run >= 0 && flight[i].tag == tag) return i;
+    return -1;
+}
+
+// --- RECOVERY ---
+void log_done(int idx, int count, const Turtle *t) {
+    if(log_count == log_cap) {
+        log_cap = log_cap ? 2 * log_cap : 1024;
+        done_log = realloc(done_log, log_cap * sizeof(Done));
+        if(!done_log) { printf("Alloc fail\n"); exit(1); }
+    }
+    Done *d = &done_log[log_count++];
+    d->idx = idx; d->count = count; d->t = *t;
+}
+
+void add_run(int idx, int end, const Turtle *t) {
+    if(run_count == MAX_RUNS) { printf("WARN: No room to replay %d..%d\n", idx, end); return; }
+    Run *r = &runs[run_count++];
+    r->idx = idx; r->end = end; r->t = *t;
+}
+
+// Does the pending move (or a whole F) touch [x0,x1)x[y0,y1)?
+int move_touches(const Turtle *t, int x0, int y0, int x1, int y1) {
+    int32_t dx, dy, t0, t1;
+    int in_side;
+    turtle_vector(t, FX_ONE, &dx, &dy);
+    return rast_clip(t->x, t->y, dx, dy, x0, y0, x1, y1, &t0, &t1, &in_side) >= 0;
+}
+
+// New runs for what done_log[from..] drew into a lost region: each stretch of F moves touching it,
+// from the state before its first F. Returns the number of commands to replay.
+int replay_lost(const char *s, int angle, int from, int x0, int y0, int x1, int y1) {
+    int cmds = 0;
+    for(int e=from; e<log_count; e++) {
+        Done *d = &done_log[e];
+        Turtle t = d->t, at = t;
+        int open = -1, end = 0;
+        if(t.rem) {
+            if(move_touches(&t, x0, y0, x1, y1)) { open = end = d->idx; }
+            turtle_advance(&t, FX_ONE);
+        }
+        for(int i=d->idx; i<d->idx + d->count; i++) {
+            char c = s[i];
+            if(c=='+') turtle_turn(&t, angle);
+            else if(c=='-') turtle_turn(&t, -angle);
+            if(c!='F') continue;
+            if(move_touches(&t, x0, y0, x1, y1)) {
+                if(open < 0) { open = i; at = t; }
+                end = i+1;
+            } else if(open >= 0) {
+                add_run(open, end, &at); cmds += end - open;
+                open = -1;
             }
+            turtle_advance(&t, FX_ONE);
         }
+        if(open >= 0) { add_run(open, end, &at); cmds += end - open; }
     }
-    sleep(1);
+    return cmds;
+}
+
+// RESPONSE (or one FRAG of it) from node i: the region is ORed into global_grid. Returns 1 once merged.
+int merge_region(int i, struct sockaddr_in *from, uint8_t *rb, int n) {
+    uint8_t *p = rb;
+    if((rb[0]&0x0F)==MSG_FRAG) {
+        if(!(n = frag_add(&ckpt[i].reasm, from, rb, n))) return 0;
+        p = ckpt[i].reasm.buf;
+    }
+    // RESPONSE = REGION_ALL rw rh + rows
+    if((p[0]&0x0F)!=MSG_RESPONSE || p[4]!=REGION_ALL || n < 7 + p[5]*p[6]) return 0;
+    int w = p[5] < nodes[i].rw ? p[5] : nodes[i].rw;
+    int h = p[6] < nodes[i].rh ? p[6] : nodes[i].rh;
+    for(int r=0; r<h; r++)
+        for(int x=0; x<w; x++)
+            if(p[7 + r*p[5] + x] == '#') global_grid[nodes[i].ry + r][nodes[i].rx + x] = '#';
+    return 1;
+}
 
-    // --- SIMULATION ---
-    double cx=19.5, cy=25.0, ca=0; // Start Center Up
-    int str_idx = 0;
-    int total = strlen(final_str);
-    int curr_node = get_node_idx((int)cx, (int)cy);
+void request_region(int sockfd, int i) {
+    uint8_t rq[8]; pack_header(rq, MSG_REQUEST, nodes[i].node_id, 1);
+    rq[4]=REGION_ALL; rq[5]=alp_crc(rq, 5);
+    frag_reset(&ckpt[i].reasm);
+    trace_sendto(sockfd, rq, 6, 0, (struct sockaddr*)&nodes[i].addr, sizeof(nodes[i].addr));
+}
 
-    printf("Starting Stream...\n");
-    struct timeval tv = {0, 400000}; // INCREASED TIMEOUT TO 400ms
+// Blocking REQUEST/RESPONSE for one node. Late ACK/HANDOVER packets (and other nodes' heartbeats)
+// may still arrive; only this node's region counts.
+int collect_node(int sockfd, int i) {
+    struct sockaddr_in cli;
+    for(int try=0; try<RETRIES; try++) {
+        struct timeval sent;
+        request_region(sockfd, i);
+        gettimeofday(&sent, NULL);
+        uint8_t rb[FRAG_MAX];
+        while(elapsed_us(&sent) < RETRY_US) {
+            int n = recv_alp(sockfd, rb, sizeof(rb), &cli);
+            if(n > 0 && node_by_addr(&cli) == i && merge_region(i, &cli, rb, n)) return 1;
+        }
+    }
+    return 0;
+}
+
+// Checkpoint: every node that has had work since its last one sends its grid (answered in the
+// simulation loop). Everything logged before the REQUEST is in that grid.
+void checkpoint(int sockfd) {
+    for(int i=0; i<node_count; i++) {
+        Ckpt *c = &ckpt[i];
+        if(c->pending >= 0) {
+            if(elapsed_us(&c->sent) < RETRY_US) continue;
+            c->pending = -1;                // no answer, ask again next time
+        }
+        if(log_count == c->covers || elapsed_us(&c->sent) < CKPT_US) continue;
+        c->pending = log_count;
+        gettimeofday(&c->sent, NULL);
+        request_region(sockfd, i);
+    }
+}
+
+void ckpt_reset(int i) {
+    ckpt[i].covers = log_count;
+    ckpt[i].pending = -1;
+    gettimeofday(&ckpt[i].sent, NULL);
+    frag_reset(&ckpt[i].reasm);
+}
+
+// Start of a job (on a sub-server: of an ASSIGN): empty log, no node has anything to lose yet
+void log_reset() {
+    log_count = 0;
+    for(int i=0; i<node_count; i++) ckpt_reset(i);
+}
+
+// Lost nodes (bitmask) hand their regions to standbys; without enough standbys the survivors
+// send their grids and the canvas is partitioned again among them. Then only the logged spans
+// that drew into a lost region since its checkpoint are queued again. Nothing may be in flight.
+// Returns 1 if the regions changed (every queued run must be routed again).
+int failover(int sockfd, const char *s, int angle, unsigned lost) {
+    SPAN("failover");
+    struct { int x0, y0, x1, y1, from; } gone[MAX_NODES];
+    int g = 0;
+    for(int i=0; i<node_count; i++) {
+        if(!(lost & (1u << i))) continue;
+        gone[g].x0 = nodes[i].rx; gone[g].y0 = nodes[i].ry;
+        gone[g].x1 = nodes[i].rx + nodes[i].rw; gone[g].y1 = nodes[i].ry + nodes[i].rh;
+        gone[g++].from = ckpt[i].covers;
+    }
+
+    int moved = 0;
+    drop_silent(standby, &standby_count);
+    if(standby_count >= g) {
+        for(int i=0; i<node_count; i++) {
+            if(!(lost & (1u << i))) continue;
+            Node sb = standby[--standby_count];
+            printf("Node %d takes over region %d,%d %dx%d of Node %d\n", sb.node_id, nodes[i].rx, nodes[i].ry, nodes[i].rw, nodes[i].rh, nodes[i].node_id);
+            sb.rx = nodes[i].rx; sb.ry = nodes[i].ry; sb.rw = nodes[i].rw; sb.rh = nodes[i].rh;
+            nodes[i] = sb;
+            ckpt_reset(i);
+            char lane[16]; snprintf(lane, sizeof(lane), "Node %d", sb.node_id);
+            span_lane(1 + i, lane);
+        }
+        struct timeval atv = {0, 400000};
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&atv, sizeof atv);
+        for(int i=0; i<node_count; i++) assign_node(sockfd, i, angle, !(lost & (1u << i)));
+    } else {
+        struct timeval atv = {0, 400000};
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&atv, sizeof atv);
+        int k = 0;
+        for(int i=0; i<node_count; i++) {
+            if(lost & (1u << i)) continue;
+            if(!collect_node(sockfd, i)) printf("WARN: No region from Node %d before repartition\n", nodes[i].node_id);
+            nodes[k++] = nodes[i];
+        }
+        node_count = k;
+        for(int i=0; i<node_count; i++) {
+            char lane[16]; snprintf(lane, sizeof(lane), "Node %d", nodes[i].node_id);
+            span_lane(1 + i, lane);
+        }
+        if(!node_count) { printf("ERROR: No nodes left\n"); return 1; }
+        printf("No standby: %d nodes share the canvas again\n", node_count);
+        partition(nodes, area_x, area_y, area_w, area_h, 0, node_count);
+        for(int i=0; i<node_count; i++) {
+            printf("Node %d Region %d,%d %dx%d\n", nodes[i].node_id, nodes[i].rx, nodes[i].ry, nodes[i].rw, nodes[i].rh);
+            ckpt_reset(i);
+            assign_node(sockfd, i, angle, 0);
+        }
+        moved = 1;
+    }
+    struct timeval tv = {0, 20000};
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+
+    for(int j=0; j<g; j++) {
+        int first = run_count;
+        int cmds = replay_lost(s, angle, gone[j].from, gone[j].x0, gone[j].y0, gone[j].x1, gone[j].y1);
+        printf("Replaying %d commands in %d spans (log %d..%d) for region %d,%d\n", cmds, run_count - first,
+               gone[j].from, log_count, gone[j].x0, gone[j].y0);
+    }
+    return moved;
+}
+
+// Sub-server: PROGRESS naming itself for the DATA being drawn, every RETRY_US/2. Retrying a lost
+// leaf takes as long as upstream waits for this whole cluster; this keeps it from giving up first.
+void up_keepalive(void) {
+    static struct timeval last;
+    if(up_fd < 0 || elapsed_us(&last) < RETRY_US / 2) return;
+    int base = runs[0].idx - up_start;
+    uint8_t pr[10];
+    pack_header(pr, MSG_PROGRESS, up_id, 5);
+    pr[4] = up_tag[0]; pr[5] = up_tag[1];
+    pr[6] = up_id;
+    pr[7] = (base >> 8) & 0xFF; pr[8] = base & 0xFF;
+    pr[9] = alp_crc(pr, 9);
+    trace_sendto(up_fd, pr, 10, 0, (struct sockaddr*)&up_addr, sizeof(up_addr));
+    gettimeofday(&last, NULL);
+}
+
+// Every node gets at most one chunk in flight; branches owned by different nodes run concurrently.
+// A node that stops answering is failed over once the other chunks in flight have finished.
+// Spans: "chunk" on the node's lane from first send to the reply, instants for pass/handover/retry
+void run_simulation(int sockfd, const char *s, int angle) {
+    SPAN("simulation");
+    int done = 0;
+    unsigned lost = 0;
+    int orphans[MAX_NODES], orphan_count = 0;
+    for(int i=0; i<MAX_NODES; i++) { q_head[i] = -1; flight[i].run = -1; }
+    for(int r=0; r<run_count; r++) done += route(s, angle, r);
+
+    struct timeval tv = {0, 20000};
     setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
 
-    while(str_idx < total) {
-        int chunk = 50; 
-        if(str_idx + chunk > total) chunk = total - str_idx;
-        
-        // Handle OOB
-        if(curr_node == -1) {
-            printf("WARN: Turtle OOB at %.1f,%.1f. Simulating blindly.\n", cx, cy);
-            for(int k=0; k<chunk; k++) {
-                char c = final_str[str_idx+k];
-                if(c=='F') {
-                    cx += my_cos(ca * MY_PI/180.0);
-                    cy += my_sin(ca * MY_PI/180.0);
-                } else if(c=='+') ca += ls.angle;
-                else if(c=='-') ca -= ls.angle;
+    while(done < run_count && node_count > 0) {
+        up_keepalive();
+        for(int i=0; i<node_count && !lost; i++) {
+            if(flight[i].run >= 0 || q_head[i] < 0) continue;
+            flight[i].run = q_head[i];
+            flight[i].holder = i;
+            q_head[i] = runs[q_head[i]].next;
+            send_chunk(sockfd, s, i, angle);
+        }
+
+        struct sockaddr_in cli;
+        uint8_t resp[FRAG_MAX];
+        int n = recv_alp(sockfd, resp, sizeof(resp), &cli);
+        int type = n > 0 ? resp[0] & 0x0F : -1;
+        int k = -1;
+        // ACK = tag(2) of a chunk the node drew to the end; a plain ACK (of an ASSIGN) is not one
+        if(type == MSG_ACK && n >= 7) {
+            k = flight_by_tag(resp);
+            if(k >= 0 && node_by_addr(&cli) != k) k = -1;
+        }
+        else if(type == MSG_HANDOVER || type == MSG_PROGRESS) k = flight_by_tag(resp);
+        else if(type == MSG_RESPONSE || type == MSG_FRAG) {
+            int i = node_by_addr(&cli);
+            if(i >= 0 && ckpt[i].pending >= 0 && merge_region(i, &cli, resp, n)) {
+                ckpt[i].covers = ckpt[i].pending;
+                ckpt[i].pending = -1;
+                span_instant("checkpoint", 1 + i, ckpt[i].covers);
             }
-            str_idx += chunk;
-            curr_node = get_node_idx((int)cx, (int)cy);
-            continue; 
-        }
-
-        uint8_t pkt[256];
-        pack_header(pkt, MSG_DATA, nodes[curr_node].node_id, 12 + chunk);
-        float fx=(float)cx; float fy=(float)cy; float fa=(float)ca;
-        memcpy(&pkt[4], &fx, 4); memcpy(&pkt[8], &fy, 4); memcpy(&pkt[12], &fa, 4);
-        memcpy(&pkt[16], &final_str[str_idx], chunk);
-        pkt[4+12+chunk] = alp_crc(pkt, 4+12+chunk);
-
-        int success = 0;
-        for(int r=0; r<5; r++) { 
-            // Debug print
-            printf("Sending to Node %d (Attempt %d)...\n", nodes[curr_node].node_id, r+1);
-            
-            sendto(sockfd, pkt, 5+12+chunk, 0, (struct sockaddr*)&nodes[curr_node].addr, sizeof(nodes[curr_node].addr));
-            
-            uint8_t resp[256]; socklen_t l = sizeof(cli);
-            int n = recvfrom(sockfd, resp, sizeof(resp), 0, (struct sockaddr*)&cli, &l);
-            
-            if(n>0) {
-                int type = resp[0] & 0x0F;
-                if(type == MSG_HANDOVER) {
-                    nodes[curr_node].addr = cli;
-                    float nx, ny, na; uint16_t proc;
-                    memcpy(&nx, &resp[4], 4); memcpy(&ny, &resp[8], 4); memcpy(&na, &resp[12], 4);
-                    proc = (resp[16]<<8) | resp[17];
-                    
-                    printf("Handover Node %d -> %.1f,%.1f. Processed %d\n", nodes[curr_node].node_id, nx, ny, proc);
-                    cx=nx; cy=ny; ca=na;
-                    str_idx += proc;
-                    curr_node = get_node_idx((int)cx, (int)cy);
-                    success = 1;
-                    send_ack(sockfd, &cli);
-                    
-                    // IMPORTANT: SLEEP TO LET NETWORK SETTLE
-                    usleep(50000); 
-                    break;
-                }
-                else if(type == MSG_ACK) {
-                    for(int k=0; k<chunk; k++) {
-                        char c = final_str[str_idx+k];
-                        if(c=='F') {
-                            cx += my_cos(ca * MY_PI/180.0);
-                            cy += my_sin(ca * MY_PI/180.0);
-                        } 
-                        else if(c=='+') ca += ls.angle;
-                        else if(c=='-') ca -= ls.angle;
-                    }
-                    str_idx += chunk;
-                    success = 1; 
-                    printf("Node %d ACKed.\n", nodes[curr_node].node_id);
-                    break;
-                }
+        }
+
+        if(type == MSG_PROGRESS && k >= 0 && resp[6] == resp[1]) {
+            // A sub-server naming itself: still drawing the chunk (retrying a leaf), the timeout starts over
+            if(node_by_addr(&cli) == flight[k].holder) gettimeofday(&flight[k].sent, NULL);
+        }
+        else if(type == MSG_PROGRESS && k >= 0) {
+            // Node passed the turtle straight to a neighbour; the chunk is still alive. The sender's
+            // PROGRESS may come after the next node's, so an older one must not move the holder back:
+            // it has done fewer commands, or it names a node that has already passed the turtle on.
+            Flight *f = &flight[k];
+            int base = (resp[7]<<8) | resp[8];
+            int from = node_by_id(resp[1]), h = node_by_id(resp[6]);
+            printf("Node %d passed turtle to Node %d after %d\n", resp[1], resp[6], base);
+            span_instant("pass", 1 + k, resp[6]);
+            if(base > f->progress) { f->progress = base; f->passed = 0; }
+            if(h >= 0 && base == f->progress && !(f->passed & (1u << h))) {
+                f->holder = h;
+                if(from >= 0) f->passed |= 1u << from;
+            }
+            gettimeofday(&f->sent, NULL);
+        }
+        else if(k >= 0 && flight[k].run >= 0) {
+            Flight *f = &flight[k];
+            Run *run = &runs[f->run];
+            int finished = -1;
+            if(type == MSG_HANDOVER) {
+                uint16_t proc = (resp[18]<<8) | resp[19];
+                log_done(run->idx, proc, &run->t);
+                turtle_get(&resp[6], &run->t);
+                printf("Handover Node %d -> %.2f,%.2f. Processed %d\n", resp[1], run->t.x / 65536.0, run->t.y / 65536.0, proc);
+                run->idx += proc;
+                send_ack(sockfd, &cli);
+                span_instant("handover", 1 + k, proc);
+                finished = f->run;
+            }
+            else if(type == MSG_ACK) {
+                log_done(run->idx, f->chunk, &run->t);
+                walk(s, run->idx, run->idx + f->chunk, angle, &run->t);
+                run->idx += f->chunk;
+                finished = f->run;
+            }
+            if(finished >= 0) {
+                span_complete("chunk", f->t0, 1 + k, f->chunk);
+                f->run = -1;
+                done += route(s, angle, finished);
             }
         }
-        if(!success) { 
-            printf("Timeout Node %d. Skipping chunk.\n", nodes[curr_node].node_id); 
-            str_idx+=chunk; 
+
+        for(int i=0; i<node_count; i++) {
+            Flight *f = &flight[i];
+            if(f->run < 0 || elapsed_us(&f->sent) < RETRY_US) continue;
+            if(f->tries < RETRIES) {
+                f->tries++;
+                span_instant("retry", 1 + i, f->tries);
+                gettimeofday(&f->sent, NULL);
+                trace_sendto(sockfd, f->pkt, f->len, 0, (struct sockaddr*)&nodes[i].addr, sizeof(nodes[i].addr));
+                continue;
+            }
+            // The chunk is redrawn from its start once the node holding the turtle is replaced
+            printf("Timeout Node %d. Node %d lost.\n", nodes[i].node_id, nodes[f->holder].node_id);
+            span_complete("chunk lost", f->t0, 1 + i, f->chunk);
+            lost |= 1u << f->holder;
+            orphans[orphan_count++] = f->run;
+            f->run = -1;
+        }
+
+        // Idle nodes that stopped talking; a node holding a turtle is left to the retries above
+        for(int i=0; i<node_count; i++) {
+            if((lost & (1u << i)) || !silent(&nodes[i])) continue;
+            int holds = 0;
+            for(int j=0; j<node_count; j++) holds |= flight[j].run >= 0 && flight[j].holder == i;
+            if(holds) continue;
+            printf("Node %d silent for %ld ms. Node lost.\n", nodes[i].node_id, elapsed_us(&nodes[i].seen) / 1000);
+            lost |= 1u << i;
+        }
+
+        int busy = 0;
+        for(int i=0; i<node_count; i++) busy |= flight[i].run >= 0;
+        if(lost && !busy) {
+            int first = run_count, qn = 0;
+            int *q = malloc(sizeof(int) * (run_count + 1));
+            if(failover(sockfd, s, angle, lost)) {
+                // Regions changed: every queued run goes to its new owner
+                for(int i=0; i<MAX_NODES; i++) {
+                    for(int r=q_head[i]; r>=0; r=runs[r].next) q[qn++] = r;
+                    q_head[i] = -1;
+                }
+            }
+            lost = 0;
+            for(int j=0; j<qn; j++) done += route(s, angle, q[j]);
+            for(int j=0; j<orphan_count; j++) done += route(s, angle, orphans[j]);
+            for(int r=first; r<run_count; r++) done += route(s, angle, r);
+            orphan_count = 0;
+            free(q);
         }
+        if(!lost) checkpoint(sockfd);
     }
+}
 
-    // --- COLLECTION ---
+// One REQUEST per node; the whole region comes back as one RESPONSE, fragmented to the path MTU.
+// Regions are ORed in, so cells saved by checkpoints of replaced nodes stay.
+// A node that does not answer is failed over like during the job: its successor redraws what it
+// drew since its last checkpoint (the finished runs route straight to done), then all are read again.
+void collect_results(int sockfd, const char *s, int angle) {
+    SPAN("collect_results");
     printf("Collecting...\n");
-    for(int i=0; i<node_count; i++) {
-        int sx = nodes[i].rx; int sy = nodes[i].ry;
-        for(int r=0; r<NODE_HEIGHT; r++) {
-            uint8_t rq[8]; pack_header(rq, MSG_REQUEST, nodes[i].node_id, 1);
-            rq[4]=r; rq[5]=alp_crc(rq, 5);
-            
-            for(int try=0; try<5; try++) {
-                sendto(sockfd, rq, 6, 0, (struct sockaddr*)&nodes[i].addr, sizeof(nodes[i].addr));
-                uint8_t rb[64]; socklen_t l=sizeof(cli);
-                if(recvfrom(sockfd, rb, sizeof(rb), 0, (struct sockaddr*)&cli, &l) > 0) {
-                    if((rb[0]&0x0F)==MSG_RESPONSE) {
-                         memcpy(&global_grid[sy+r][sx], &rb[4], NODE_WIDTH);
-                         break;
-                    }
-                }
+    for(int pass=0; pass <= MAX_NODES + MAX_STANDBY && node_count > 0; pass++) {
+        unsigned lost = 0;
+        for(int i=0; i<node_count; i++) {
+            uint64_t t0 = span_now();
+            int got = collect_node(sockfd, i);
+            if(!got) { printf("WARN: No region from Node %d\n", nodes[i].node_id); lost |= 1u << i; }
+            span_complete("merge", t0, 1 + i, got);
+        }
+        if(!lost) return;
+        failover(sockfd, s, angle, lost);
+        run_simulation(sockfd, s, angle);
+    }
+}
+
+// --- LOCAL BACKEND ---
+// A job given as local:<file> is drawn by ALP_THREADS worker threads (default MAX_NODES) in this
+// process instead of the node fleet. Same partition; every worker draws its region the way
+// Node/node.c does (draw_turtle_smart) and hands the turtle straight to the owner of the next
+// region. Runs are handed over by index on lock-free stacks, the Run itself is the turtle state,
+// so nothing is encoded. The worker grids are ORed into global_grid at the end.
+typedef struct {
+    Node *reg;
+    int inbox;                  // stack of runs linked by Run.next, -1 = empty; pushed by anyone
+    long cmds, handovers;
+    char grid[GRID_WIDTH * GRID_HEIGHT];
+    pthread_t th;
+} Worker;
+
+Node local_regions[MAX_THREADS];
+Worker workers[MAX_THREADS];
+int worker_count;
+const char *local_s;
+int local_angle;
+int local_left;                 // runs not finished yet; the workers stop at 0
+
+int local_owner(int x, int y) {
+    if(x<0 || x>=GRID_WIDTH || y<0 || y>=GRID_HEIGHT) return -1;
+    for(int i=0; i<worker_count; i++) {
+        Node *g = &local_regions[i];
+        if(x >= g->rx && x < g->rx + g->rw && y >= g->ry && y < g->ry + g->rh) return i;
+    }
+    return -1;
+}
+
+// Only the consumer pops, and it takes the whole stack at once, so a CAS push has no ABA
+void local_push(int w, int r) {
+    int head = __atomic_load_n(&workers[w].inbox, __ATOMIC_RELAXED);
+    do runs[r].next = head;
+    while(!__atomic_compare_exchange_n(&workers[w].inbox, &head, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Run goes to the worker owning its cell. Returns that worker, -1 when the run is finished.
+int local_route(int r) {
+    int w = next_owner(local_s, local_angle, &runs[r], local_owner);
+    if(w < 0) __atomic_fetch_sub(&local_left, 1, __ATOMIC_RELEASE);
+    else local_push(w, r);
+    return w;
+}
+
+void plot_local(int cx, int cy, void *ctx) {
+    Worker *w = ctx;
+    Node *g = w->reg;
+    if(cx >= g->rx && cx < g->rx + g->rw && cy >= g->ry && cy < g->ry + g->rh) w->grid[(cy - g->ry) * g->rw + cx - g->rx] = '#';
+}
+
+// draw_turtle_smart on the command string: until the run ends or a move leaves the region
+// (the turtle then stands on the border, t->rem = the rest of the move for the next owner)
+void local_draw(Worker *w, Run *run) {
+    Node *g = w->reg;
+    Turtle *t = &run->t;
+    int x1 = g->rx + g->rw, y1 = g->ry + g->rh;
+    if(t->rem && turtle_forward(t, FX_ONE, g->rx, g->ry, x1, y1, plot_local, w)) return;
+    while(run->idx < run->end) {
+        char c = local_s[run->idx++];
+        w->cmds++;
+        if(c=='F') { if(turtle_forward(t, FX_ONE, g->rx, g->ry, x1, y1, plot_local, w)) return; }
+        else if(c=='+') turtle_turn(t, local_angle);
+        else if(c=='-') turtle_turn(t, -local_angle);
+    }
+}
+
+void *local_worker(void *arg) {
+    SPAN("worker");
+    Worker *w = arg;
+    int self = w - workers;
+    while(__atomic_load_n(&local_left, __ATOMIC_ACQUIRE) > 0) {
+        int r = __atomic_exchange_n(&w->inbox, -1, __ATOMIC_ACQUIRE);
+        if(r < 0) { sched_yield(); continue; }
+        while(r >= 0) {
+            int next = runs[r].next;    // local_route links the run into another stack
+            local_draw(w, &runs[r]);
+            int to = local_route(r);
+            if(to >= 0 && to != self) w->handovers++;
+            r = next;
+        }
+    }
+    return NULL;
+}
+
+void run_local(const char *s, int angle) {
+    SPAN("local");
+    const char *th_env = getenv("ALP_THREADS");
+    worker_count = th_env ? atoi(th_env) : MAX_NODES;
+    if(worker_count < 1) worker_count = 1;
+    if(worker_count > MAX_THREADS) worker_count = MAX_THREADS;
+    for(int i=0; i<worker_count; i++) {
+        local_regions[i].cells = GRID_WIDTH * GRID_HEIGHT;
+        local_regions[i].kcps = 0;
+    }
+    partition(local_regions, 0, 0, GRID_WIDTH, GRID_HEIGHT, 0, worker_count);
+
+    local_s = s; local_angle = angle;
+    local_left = run_count;
+    for(int i=0; i<worker_count; i++) {
+        Worker *w = &workers[i];
+        w->reg = &local_regions[i];
+        w->inbox = -1;
+        w->cmds = w->handovers = 0;
+        memset(w->grid, '.', sizeof(w->grid));
+        printf("Worker %d Region %d,%d %dx%d\n", i, w->reg->rx, w->reg->ry, w->reg->rw, w->reg->rh);
+    }
+    for(int r=0; r<run_count; r++) local_route(r);
+    for(int i=0; i<worker_count; i++) pthread_create(&workers[i].th, NULL, local_worker, &workers[i]);
+
+    long cmds = 0, handovers = 0;
+    for(int i=0; i<worker_count; i++) {
+        Worker *w = &workers[i];
+        Node *g = w->reg;
+        pthread_join(w->th, NULL);
+        for(int y=0; y<g->rh; y++)
+            for(int x=0; x<g->rw; x++)
+                if(w->grid[y * g->rw + x] == '#') global_grid[g->ry + y][g->rx + x] = '#';
+        cmds += w->cmds; handovers += w->handovers;
+    }
+    printf("Local: %d workers drew %ld commands, %ld handovers\n", worker_count, cmds, handovers);
+}
+
+// A job argument is a file, or local:<file> for the local backend
+int job_local(const char *arg) { return strncmp(arg, "local:", 6) == 0; }
+const char *job_file(const char *arg) { return job_local(arg) ? arg + 6 : arg; }
+
+// Everything a job needs before the network: file, expansion, pre-trace (runs + density).
+// The start is fixed, so the first job is prepared on a worker thread while nodes register.
+typedef struct {
+    const char *file;
+    LSystem *ls;
+    char *out;
+    int ok;
+} Prep;
+
+void *prepare_job(void *arg) {
+    Prep *p = arg;
+    p->ok = load_lsystem(p->file, p->ls) == 0;
+    if(!p->ok) return NULL;
+    generate_lsystem(p->ls, p->out);
+    Turtle start = { FX(19.5), FX(25.0), 0, 0 }; // Start Center Up
+    memset(density, 0, sizeof(density));
+    split_runs(p->out, p->ls->angle, start);
+    return NULL;
+}
+
+// --- FEDERATION ---
+// ALP_UPSTREAM=ip:port turns this server into a sub-server: it registers there as node ALP_ID
+// and to that server its whole cluster is one node with a big region. ASSIGN gives the
+// sub-canvas, which is partitioned among the local nodes. Every DATA chunk runs here as one run
+// until the turtle leaves the sub-canvas; the reply is a HANDOVER with that state, and the upstream
+// server forwards the turtle to the next sub-server; until then PROGRESS naming this sub-server
+// keeps upstream from timing the chunk out while a lost leaf is retried. The commands of every DATA are appended to one
+// buffer and done_log runs over all of them until the next ASSIGN, so a node lost at any time (also
+// while the results are collected) gets everything it drew since its checkpoint again. REQUEST
+// REGION_ALL is answered from this cluster's nodes. Sub-servers can have sub-servers of their own.
+void serve_upstream(int sockfd, const struct sockaddr_in *up, int my_id) {
+    static char str[MAX_STR];
+    int str_len = 0;
+    static Reasm up_reasm;
+    static uint8_t pkt[FRAG_MAX];
+    int upfd = socket(AF_INET, SOCK_DGRAM, 0);
+    int up_mtu = path_mtu(up);
+    int angle = 0, sx = 0, sy = 0, sw = 0, sh = 0;
+    struct timeval tv400 = {0, 400000};
+    frag_reset(&up_reasm);
+
+    // REGISTER payload: capabilities of the whole cluster - it reassembles up to FRAG_MAX,
+    // holds what its nodes hold together, decodes everything and is as fast as its nodes together
+    Caps caps = { FRAG_MAX, fleet_cells(), CAPS_ENC_ALL, 0 };
+    for(int i=0; i<node_count; i++) caps.kcps += node_weight(&nodes[i]);
+    if(caps.cells > GRID_WIDTH * GRID_HEIGHT) caps.cells = GRID_WIDTH * GRID_HEIGHT;
+    uint8_t rg[16]; pack_header(rg, MSG_REGISTER, my_id, CAPS_LEN);
+    caps_put(&rg[4], &caps);
+    rg[4 + CAPS_LEN] = alp_crc(rg, 4 + CAPS_LEN);
+    setsockopt(upfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv400, sizeof tv400);
+    for(;;) {
+        trace_sendto(upfd, rg, 5 + CAPS_LEN, 0, (const struct sockaddr*)up, sizeof(*up));
+        int n = trace_recvfrom(upfd, pkt, sizeof(pkt), 0, NULL, NULL);
+        if(n > 0 && (pkt[0]&0x0F) == MSG_ACK) break;
+    }
+    printf("Registered upstream as Node %d\n", my_id);
+    up_id = my_id; up_addr = *up;
+    // Heartbeat upstream whenever idle: to that server this cluster is a node like any other
+    struct timeval hb_tv = {0, HEARTBEAT_US}, hb_last = {0, 0};
+    setsockopt(upfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&hb_tv, sizeof hb_tv);
+
+    // Tag of the last DATA and the reply: a retransmission is answered again without redrawing
+    uint8_t last_reply[32];
+    int last_tag = -1;
+
+    for(;;) {
+        if(elapsed_us(&hb_last) >= HEARTBEAT_US) {
+            uint8_t hb[5]; pack_header(hb, MSG_HEARTBEAT, my_id, 0); hb[4] = alp_crc(hb, 4);
+            trace_sendto(upfd, hb, 5, 0, (const struct sockaddr*)up, sizeof(*up));
+            gettimeofday(&hb_last, NULL);
+        }
+        int n = trace_recvfrom(upfd, pkt, sizeof(pkt), 0, NULL, NULL);
+        if(n < 5) continue;
+        if((pkt[0]&0x0F) == MSG_REGISTER) {
+            // The upstream server does not know us (any more): register again
+            trace_sendto(upfd, rg, 5 + CAPS_LEN, 0, (const struct sockaddr*)up, sizeof(*up));
+            continue;
+        }
+        uint8_t *p = pkt;
+        if((p[0]&0x0F) == MSG_FRAG) {
+            if(!(n = frag_add(&up_reasm, NULL, pkt, n))) continue;
+            p = up_reasm.buf;
+        }
+        int type = p[0] & 0x0F;
+
+        if(type == MSG_ASSIGN && n >= 10) {
+            send_ack(upfd, (struct sockaddr_in*)up);
+            sx = p[4]; sy = p[5]; sw = p[6]; sh = p[7]; angle = p[8];
+            area_x = sx; area_y = sy; area_w = sw; area_h = sh;
+            if(p[9] & ASSIGN_KEEP) continue;        // only the upstream peer table changed
+            // New job: fresh sub-canvas, split evenly (no pre-trace here) with the density history
+            printf("Sub-canvas %d,%d %dx%d, angle %d\n", sx, sy, sw, sh, angle);
+            in_job = 0;
+            memset(density, 0, sizeof(density));
+            rebalance(sockfd, sx, sy, sw, sh);
+            in_job = 1;
+            memset(global_grid, '.', sizeof(global_grid));
+            partition(nodes, sx, sy, sw, sh, 0, node_count);
+            setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv400, sizeof tv400);
+            for(int i=0; i<node_count; i++) {
+                printf("Node %d Region %d,%d %dx%d\n", nodes[i].node_id, nodes[i].rx, nodes[i].ry, nodes[i].rw, nodes[i].rh);
+                assign_node(sockfd, i, angle, 0);
             }
+            str_len = 0;
+            log_reset();
+            last_tag = -1;
+            sent_cmds = sent_chunks = 0;
+        }
+        else if(type == MSG_DATA && n >= 21) {
+            // DATA = tag(2) state(12) count(2) + compressed commands; the tag is new for every chunk
+            int tag = (p[4] << 8) | p[5];
+            if(tag == last_tag) {
+                trace_sendto(upfd, last_reply, 21, 0, (const struct sockaddr*)up, sizeof(*up));
+                continue;
+            }
+            int count = (p[18] << 8) | p[19];
+            int enc_len = ((p[2] << 8) | p[3]) - 16;
+            if(enc_len < 0 || 20 + enc_len > n || count >= MAX_STR) continue;
+            if(str_len + count >= MAX_STR) {
+                // Buffer full: every node's grid is merged now, then the log starts over
+                printf("Command buffer full, pulling all regions\n");
+                for(int i=0; i<node_count; i++)
+                    if(!collect_node(sockfd, i)) printf("WARN: No region from Node %d\n", nodes[i].node_id);
+                str_len = 0;
+                log_reset();
+            }
+            CmdReader cr;
+            cmd_reader(&cr, &p[20], enc_len);
+            int start = str_len;
+            while(str_len < start + count) {
+                char c = cmd_next(&cr);
+                if(!c) break;
+                str[str_len++] = c;
+            }
+            str[str_len] = 0;
+
+            run_count = 1;
+            runs[0].idx = start; runs[0].end = str_len;
+            turtle_get(&p[6], &runs[0].t);
+            up_fd = upfd; up_start = start;
+            up_tag[0] = p[4]; up_tag[1] = p[5];
+            run_simulation(sockfd, str, angle);
+            up_fd = -1;
+
+            // HANDOVER = tag(2) state(12) processed(2), also when the whole chunk was drawn here
+            int proc = runs[0].idx - start;
+            uint8_t *r = last_reply;
+            pack_header(r, MSG_HANDOVER, my_id, 16);
+            r[4] = p[4]; r[5] = p[5];
+            turtle_put(&r[6], &runs[0].t);
+            r[18] = (proc >> 8) & 0xFF; r[19] = proc & 0xFF;
+            r[20] = alp_crc(r, 20);
+            last_tag = tag;
+            trace_sendto(upfd, r, 21, 0, (const struct sockaddr*)up, sizeof(*up));
+        }
+        else if(type == MSG_REQUEST && p[4] == REGION_ALL) {
+            setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv400, sizeof tv400);
+            collect_results(sockfd, str, angle);
+            // RESPONSE = REGION_ALL rw rh + rows of the sub-canvas
+            static uint8_t all[GRID_WIDTH * GRID_HEIGHT + 16];
+            pack_header(all, MSG_RESPONSE, my_id, 3 + sw * sh);
+            all[4] = REGION_ALL; all[5] = sw; all[6] = sh;
+            for(int y=0; y<sh; y++) memcpy(&all[7 + y*sw], &global_grid[sy + y][sx], sw);
+            all[7 + sw*sh] = alp_crc(all, 7 + sw*sh);
+            frag_send(upfd, up, all, 8 + sw*sh, up_mtu);
         }
     }
+}
 
-    printf("\n=== RESULT ===\n");
-    for(int y=0; y<GRID_HEIGHT; y++) {
-        for(int x=0; x<GRID_WIDTH; x++) putchar(global_grid[y][x]);
-        putchar('\n');
+// --- MAIN ---
+int main(int argc, char *argv[]) {
+    // ALP_PORT: port the nodes register on (several servers on one host)
+    // ALP_UPSTREAM=ip:port, ALP_ID=n: run as sub-server n of that server instead of reading jobs
+    const char *port_env = getenv("ALP_PORT"), *up_env = getenv("ALP_UPSTREAM"), *id_env = getenv("ALP_ID");
+    struct sockaddr_in up;
+    if(up_env) {
+        char ip[64]; int up_port = PORT;
+        memset(&up, 0, sizeof(up));
+        up.sin_family = AF_INET;
+        if(sscanf(up_env, "%63[^:]:%d", ip, &up_port) < 1 || inet_pton(AF_INET, ip, &up.sin_addr) != 1) {
+            printf("Bad ALP_UPSTREAM %s\n", up_env); return 1;
+        }
+        up.sin_port = htons(up_port);
+        upstream = 1;
+    }
+    if(argc<2 && !upstream) { printf("Usage: %s [local:]<file> [[local:]file...]\n", argv[0]); return 1; }
+    // The fleet is only waited for if some job uses it
+    int fleet = upstream;
+    for(int job=1; job<argc; job++) fleet |= !job_local(argv[job]);
+    
+    static LSystem ls; static char final_str[MAX_STR];
+    turtle_init();
+    load_history();
+
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in serv;
+    memset(&serv, 0, sizeof(serv));
+    serv.sin_family = AF_INET; serv.sin_addr.s_addr = INADDR_ANY; serv.sin_port = htons(port_env ? atoi(port_env) : PORT);
+    if(bind(sockfd, (struct sockaddr*)&serv, sizeof(serv)) < 0) { perror("bind"); return 1; }
+    trace_open("server");   // ALP_TRACE=<file> records every datagram (Common/trace.h)
+
+    // ALP_SPANS=<file.json>: phase timings as Chrome trace events (Common/span.h); lane 1+i = node i
+    span_lane(0, "server");
+    uint64_t reg_t0 = span_now();
+
+    Prep prep = { upstream ? NULL : job_file(argv[1]), &ls, final_str, 0 };
+    pthread_t prep_thread;
+    int prep_async = !upstream && pthread_create(&prep_thread, NULL, prepare_job, &prep) == 0;
+    // ALP_STANDBY=n: n more nodes register as spares for failover
+    // ALP_QUORUM=n: start with n nodes once no more have come for START_GRACE_US (default: a majority)
+    const char *sb_env = getenv("ALP_STANDBY"), *q_env = getenv("ALP_QUORUM");
+    want_standby = sb_env ? atoi(sb_env) : 0;
+    if(want_standby < 0) want_standby = 0;
+    if(want_standby > MAX_STANDBY) want_standby = MAX_STANDBY;
+    if(q_env) quorum = atoi(q_env);
+    if(quorum < 1) quorum = 1;
+    if(quorum > MAX_NODES) quorum = MAX_NODES;
+    if(fleet) {
+        printf("Waiting for nodes...\n");
+        // A sub-server learns its sub-canvas only with the first ASSIGN. The first job is still being
+        // prepared, so only the total is compared here; rebalance tries the split.
+        wait_fleet(sockfd, upstream ? 0 : GRID_WIDTH * GRID_HEIGHT);
+    }
+    span_complete("registration", reg_t0, 0, node_count);
+    if(upstream) {
+        serve_upstream(sockfd, &up, id_env ? atoi(id_env) : 1);
+        return 0;
+    }
+
+    // One job per file. Regions are recomputed before every job from its pre-trace and the history.
+    for(int job=1; job<argc; job++) {
+        uint64_t t0 = span_now();
+        if(job == 1 && prep_async) {
+            pthread_join(prep_thread, NULL);
+            span_complete("wait_prepare", t0, 0, -1);
+        } else {
+            prep.file = job_file(argv[job]);
+            prepare_job(&prep);
+        }
+        if(!prep.ok) { printf("Cannot load %s\n", prep.file); continue; }
+        memset(global_grid, '.', sizeof(global_grid));
+        printf("L-System %s: %lu chars\n", argv[job], strlen(final_str));
+
+        if(!job_local(argv[job])) rebalance(sockfd, 0, 0, GRID_WIDTH, GRID_HEIGHT);
+        if(job_local(argv[job]) || !fleet_fits(0, 0, GRID_WIDTH, GRID_HEIGHT)) {
+            // Also when even the complete fleet cannot hold the canvas: no rows get lost that way
+            if(!job_local(argv[job])) printf("Fleet too small for the canvas, drawing here\n");
+            printf("Starting local workers... (%d branches)\n", run_count);
+            run_local(final_str, ls.angle);
+        } else {
+            in_job = 1;
+            t0 = span_now();
+            partition(nodes, 0, 0, GRID_WIDTH, GRID_HEIGHT, 0, node_count);
+            span_complete("partition", t0, 0, -1);
+
+            // ASSIGN goes out once every address is known, so nodes can hand over to each other directly
+            struct timeval atv = {0, 400000};
+            setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&atv, sizeof atv);
+            t0 = span_now();
+            for(int i=0; i<node_count; i++) {
+                printf("Node %d Region %d,%d %dx%d\n", nodes[i].node_id, nodes[i].rx, nodes[i].ry, nodes[i].rw, nodes[i].rh);
+                assign_node(sockfd, i, ls.angle, 0);
+            }
+            span_complete("ASSIGN", t0, 0, job);
+
+            // --- SIMULATION ---
+            printf("Starting Stream... (%d branches)\n", run_count);
+            sent_cmds = sent_chunks = 0;
+            log_reset();
+            run_simulation(sockfd, final_str, ls.angle);
+            printf("Streamed %ld commands in %ld DATA packets\n", sent_cmds, sent_chunks);
+
+            struct timeval tv = {0, 400000};
+            setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+
+            // --- COLLECTION ---
+            collect_results(sockfd, final_str, ls.angle);
+            in_job = 0;
+        }
+        t0 = span_now();
+        save_history();
+        span_complete("save_history", t0, 0, -1);
+
+        printf("\n=== RESULT ===\n");
+        for(int y=0; y<GRID_HEIGHT; y++) {
+            for(int x=0; x<GRID_WIDTH; x++) putchar(global_grid[y][x]);
+            putchar('\n');
+        }
     }
     return 0;
-}
\ No newline at end of file
+}